@@ -0,0 +1,326 @@
+/**
+ * @file    connection_manager.c
+ * @brief   Keeps the Wi-Fi, TCP and MQTT layers connected.
+ *
+ * The manager remembers the lowest layer that is down. ESP8266 status lines
+ * lower it ("WIFI DISCONNECT" to Wi-Fi, "CLOSED" to TCP) and so does a lost
+ * MQTT session, to TCP as MQTT allows one CONNECT per network connection.
+ * Layers are then brought up one after another starting there, so a
+ * dropped socket costs a TCP and MQTT connect, not a Wi-Fi rejoin.
+ * A layer that keeps failing is escalated to the layer below it, which
+ * catches failures no status line reports. An existing Wi-Fi association
+ * is reused, except after such an escalation.
+ */
+
+#include "connection_manager.h"
+#include "esp8266.h"
+#include "stm_mqtt.h"
+#include "stm32l4xx_hal.h"
+#include <stddef.h>
+
+/**
+ * @brief Progress of a connection attempt.
+ */
+typedef enum
+{
+    ATTEMPT_RUNNING,   /**< Still in progress, polled again on the next call */
+    ATTEMPT_SUCCEEDED, /**< Layer is up */
+    ATTEMPT_FAILED     /**< Layer could not be established */
+} attempt_result_t;
+
+static connection_manager_config_t s_config;
+static connection_layer_t s_layer = CONNECTION_LAYER_WIFI; /**< Lowest layer that is down */
+static uint8_t s_attempts = 0;            /**< Failed attempts on the current layer */
+static uint32_t s_backoff = CONNECTION_MANAGER_BACKOFF_MIN; /**< Base delay before the next attempt */
+static uint32_t s_next_attempt_tick = 0;  /**< Time of the next attempt */
+static uint32_t s_random_state = 1;       /**< State of the jitter generator, never 0 */
+static bool s_rejoin = false;             /**< Leave the Wi-Fi network before joining, the association may be stale */
+static bool s_attempt_started = false;    /**< ESP8266 operation of the current attempt is queued */
+static bool s_reopen_tcp = false;         /**< A CONNECT failed on the current TCP connection */
+
+/**
+ * @brief Returns a pseudo random number for backoff jitter.
+ * @retval Random value.
+ */
+static uint32_t next_random(void)
+{
+    // xorshift32
+    s_random_state ^= s_random_state << 13;
+    s_random_state ^= s_random_state >> 17;
+    s_random_state ^= s_random_state << 5;
+    return s_random_state;
+}
+
+/**
+ * @brief Marks a layer and every layer above it as down.
+ * @param layer Layer that failed.
+ */
+static void layer_down(connection_layer_t layer)
+{
+    if (layer >= s_layer)
+    {
+        return; // Already being re-established from this layer or below
+    }
+    s_layer = layer;
+    s_attempts = 0;
+    s_backoff = CONNECTION_MANAGER_BACKOFF_MIN;
+    s_next_attempt_tick = HAL_GetTick();
+    s_attempt_started = false; // An operation still running is waited for, its result is ignored
+    if (layer < CONNECTION_LAYER_MQTT)
+    {
+        stm_mqtt_connection_lost();
+    }
+}
+
+/**
+ * @brief Handles unsolicited ESP8266 status lines.
+ * @param event Reported status.
+ */
+static void on_esp8266_event(esp8266_event_t event)
+{
+    switch (event)
+    {
+    case ESP8266_EVENT_WIFI_DISCONNECTED:
+        layer_down(CONNECTION_LAYER_WIFI);
+        break;
+
+    case ESP8266_EVENT_TCP_CLOSED:
+        layer_down(CONNECTION_LAYER_TCP);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Maps the status of the running ESP8266 operation to an attempt result.
+ * @retval Result of the current attempt.
+ */
+static attempt_result_t operation_result(void)
+{
+    switch (esp8266_operation_status())
+    {
+    case ESP8266_OPERATION_RUNNING:
+        return ATTEMPT_RUNNING;
+
+    case ESP8266_OPERATION_SUCCEEDED:
+        return ATTEMPT_SUCCEEDED;
+
+    default:
+        return ATTEMPT_FAILED;
+    }
+}
+
+/**
+ * @brief Opens a new TCP connection to the broker and selects how it transmits.
+ *
+ * Closing and opening run in the AT engine. Only the final switch to
+ * transparent transmission (at most about 3.5 s) or passive reception
+ * (at most 1 s) blocks.
+ * @retval Result of the attempt.
+ */
+static attempt_result_t establish_tcp(void)
+{
+    if (!s_attempt_started)
+    {
+        // Do not reuse a socket that may be half open, the operation closes it first
+        if (!esp8266_start_tcp_connect(s_config.broker_address, s_config.broker_port))
+        {
+            return ATTEMPT_FAILED;
+        }
+        s_attempt_started = true;
+    }
+    attempt_result_t result = operation_result();
+    if (result != ATTEMPT_SUCCEEDED)
+    {
+        return result;
+    }
+    if (s_config.passthrough && esp8266_start_passthrough())
+    {
+        return ATTEMPT_SUCCEEDED; // Otherwise one AT+CIPSEND per packet
+    }
+    if (s_config.passive_receive)
+    {
+        esp8266_set_passive_receive(true); // Falls back to active reception if refused
+    }
+    return ATTEMPT_SUCCEEDED;
+}
+
+/**
+ * @brief Advances the attempt to bring one layer up, called until it is no longer running.
+ *
+ * Wi-Fi and TCP attempts are queued to the ESP8266 AT engine and polled,
+ * so a 20 s AT+CWJAP does not stall the main loop. The MQTT CONNECT
+ * blocks for at most TRANSMIT_TIMEOUT + RESPONSE_TIMEOUT of stm_mqtt.c.
+ * @param layer Layer to establish, the layers below it must be up.
+ * @retval Result of the attempt.
+ */
+static attempt_result_t establish(connection_layer_t layer)
+{
+    attempt_result_t result;
+
+    switch (layer)
+    {
+    case CONNECTION_LAYER_WIFI:
+        if (!s_attempt_started)
+        {
+            // A rejoin leaves the network first, the association may be stale
+            if (!esp8266_start_network_connect(s_config.essid, s_config.password, s_rejoin))
+            {
+                return ATTEMPT_FAILED;
+            }
+            s_attempt_started = true;
+        }
+        return operation_result();
+
+    case CONNECTION_LAYER_TCP:
+        result = establish_tcp();
+        if (result == ATTEMPT_SUCCEEDED)
+        {
+            s_reopen_tcp = false;
+        }
+        return result;
+
+    case CONNECTION_LAYER_MQTT:
+        if (s_reopen_tcp)
+        {
+            // The failed attempt sent CONNECT on this socket, MQTT allows one per network connection
+            result = establish_tcp();
+            if (result != ATTEMPT_SUCCEEDED)
+            {
+                return result;
+            }
+            s_reopen_tcp = false;
+        }
+        if (stm_mqtt_connect_session(s_config.client_id, s_config.keep_alive))
+        {
+            return ATTEMPT_SUCCEEDED;
+        }
+        s_reopen_tcp = true;
+        return ATTEMPT_FAILED;
+
+    default:
+        return ATTEMPT_SUCCEEDED;
+    }
+}
+
+/**
+ * @brief Schedules the next attempt with jittered exponential backoff.
+ *
+ * The delay is drawn from [backoff / 2, backoff] so that several nodes
+ * losing the same access point do not retry in lockstep.
+ */
+static void schedule_retry(void)
+{
+    uint32_t delay = s_backoff / 2 + next_random() % (s_backoff / 2 + 1);
+    s_next_attempt_tick = HAL_GetTick() + delay;
+    s_backoff = (s_backoff * 2 > CONNECTION_MANAGER_BACKOFF_MAX) ? CONNECTION_MANAGER_BACKOFF_MAX : s_backoff * 2;
+}
+
+/**
+ * @brief Starts managing the connection, the first attempt is made from connection_manager_process().
+ * @param config Pointer to the connection parameters, copied.
+ */
+void connection_manager_init(const connection_manager_config_t *config)
+{
+    s_config = *config;
+    s_layer = CONNECTION_LAYER_WIFI;
+    s_attempts = 0;
+    s_backoff = CONNECTION_MANAGER_BACKOFF_MIN;
+    s_next_attempt_tick = HAL_GetTick();
+    s_rejoin = false;
+    s_attempt_started = false;
+    s_reopen_tcp = false;
+    s_random_state = HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2();
+    if (s_random_state == 0)
+    {
+        s_random_state = 1;
+    }
+    esp8266_set_multiple_connections(s_config.multiple_connections);
+    esp8266_set_event_callback(on_esp8266_event);
+}
+
+/**
+ * @brief Runs the MQTT client and re-establishes failed layers.
+ */
+void connection_manager_process(void)
+{
+    stm_mqtt_process();
+
+    if (s_layer == CONNECTION_LAYER_ONLINE && !stm_mqtt_is_connected())
+    {
+        // Keep alive declared the link dead or the broker sent DISCONNECT. The socket is dead
+        // or still carries the old session, a new CONNECT needs a new TCP connection.
+        layer_down(CONNECTION_LAYER_TCP);
+    }
+    if (s_layer == CONNECTION_LAYER_ONLINE)
+    {
+        return;
+    }
+    if (!s_attempt_started)
+    {
+        if ((int32_t)(HAL_GetTick() - s_next_attempt_tick) < 0
+            || esp8266_operation_status() == ESP8266_OPERATION_RUNNING) // Left over from an abandoned attempt
+        {
+            return;
+        }
+    }
+
+    connection_layer_t layer = s_layer;
+    attempt_result_t result = establish(layer);
+    if (result == ATTEMPT_RUNNING)
+    {
+        return;
+    }
+    s_attempt_started = false;
+    if (s_layer != layer)
+    {
+        return; // A lower layer failed during the attempt, start over from there
+    }
+
+    if (result == ATTEMPT_SUCCEEDED)
+    {
+        if (s_layer == CONNECTION_LAYER_WIFI)
+        {
+            s_rejoin = false;
+        }
+        s_layer = (connection_layer_t)(s_layer + 1);
+        s_attempts = 0;
+        s_backoff = CONNECTION_MANAGER_BACKOFF_MIN;
+        s_next_attempt_tick = HAL_GetTick(); // Next layer right away
+        if (s_layer == CONNECTION_LAYER_ONLINE && s_config.online_callback != NULL)
+        {
+            s_config.online_callback(stm_mqtt_session_present());
+        }
+        return;
+    }
+
+    if (++s_attempts >= CONNECTION_MANAGER_ESCALATE_ATTEMPTS && s_layer > CONNECTION_LAYER_WIFI)
+    {
+        // The layer below may be broken without a status line saying so
+        s_layer = (connection_layer_t)(s_layer - 1);
+        s_attempts = 0;
+        s_rejoin = (s_layer == CONNECTION_LAYER_WIFI);
+        stm_mqtt_connection_lost();
+    }
+    schedule_retry();
+}
+
+/**
+ * @brief Tells whether every layer is up.
+ * @retval true if MQTT packets can be sent, false otherwise.
+ */
+bool connection_manager_is_online(void)
+{
+    return s_layer == CONNECTION_LAYER_ONLINE;
+}
+
+/**
+ * @brief Returns the lowest layer that is down.
+ * @retval Layer to be re-established next, CONNECTION_LAYER_ONLINE if none.
+ */
+connection_layer_t connection_manager_get_layer(void)
+{
+    return s_layer;
+}
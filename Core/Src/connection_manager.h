@@ -0,0 +1,84 @@
+/**
+ * @file    connection_manager.h
+ * @brief   Keeps the Wi-Fi, TCP and MQTT layers connected.
+ *
+ * Each layer is tracked separately. When one fails, only that layer and the
+ * ones above it are re-established, with jittered exponential backoff
+ * between attempts.
+ */
+
+#ifndef _CONNECTION_MANAGER_H_
+#define _CONNECTION_MANAGER_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#define CONNECTION_MANAGER_BACKOFF_MIN      500   /**< First retry delay in milliseconds */
+#define CONNECTION_MANAGER_BACKOFF_MAX      30000 /**< Longest retry delay in milliseconds */
+#define CONNECTION_MANAGER_ESCALATE_ATTEMPTS 3    /**< Failed attempts after which the layer below is re-established too */
+
+/**
+ * @brief Connection layers, each one requires the ones before it.
+ */
+typedef enum
+{
+    CONNECTION_LAYER_WIFI,   /**< Associated with the access point */
+    CONNECTION_LAYER_TCP,    /**< TCP connection to the broker open */
+    CONNECTION_LAYER_MQTT,   /**< Broker accepted the MQTT session */
+    CONNECTION_LAYER_ONLINE  /**< All layers up */
+} connection_layer_t;
+
+/**
+ * @brief Function notified each time the MQTT session is (re-)established.
+ *
+ * Used to restore subscriptions when the broker did not keep them.
+ *
+ * @param session_present true if the broker resumed a persistent session with its subscriptions.
+ */
+typedef void (*connection_manager_online_callback_t)(bool session_present);
+
+/**
+ * @brief Connection parameters, the strings must stay valid while the manager runs.
+ */
+typedef struct
+{
+    const char *essid;           /**< Wi-Fi network name */
+    const char *password;        /**< Wi-Fi password */
+    const char *broker_address;  /**< IP address of the MQTT broker */
+    int broker_port;             /**< Port of the MQTT broker */
+    const char *client_id;       /**< MQTT client identifier */
+    int keep_alive;              /**< MQTT keep alive in seconds */
+    bool passthrough;            /**< Use transparent transmission on the TCP connection, keep alive then detects a dead link */
+    bool passive_receive;        /**< Pull received data as buffer space allows, used when transparent transmission is off or refused */
+    bool multiple_connections;   /**< Broker on ESP8266_PRIMARY_LINK, other links free for esp8266_socket_open(), excludes transparent transmission */
+    connection_manager_online_callback_t online_callback; /**< Notified when online, may be NULL */
+} connection_manager_config_t;
+
+/**
+ * @brief Starts managing the connection, the first attempt is made from connection_manager_process().
+ * @param config Pointer to the connection parameters, copied.
+ */
+void connection_manager_init(const connection_manager_config_t *config);
+
+/**
+ * @brief Runs the MQTT client and re-establishes failed layers, must be called periodically from the main loop.
+ *
+ * Wi-Fi and TCP attempts run in the ESP8266 AT engine and are polled here. Blocking is
+ * bounded: leaving transparent transmission about 1.1 s, entering it about 3.5 s,
+ * passive reception 1 s and the MQTT CONNECT about 2 s.
+ */
+void connection_manager_process(void);
+
+/**
+ * @brief Tells whether every layer is up.
+ * @retval true if MQTT packets can be sent, false otherwise.
+ */
+bool connection_manager_is_online(void);
+
+/**
+ * @brief Returns the lowest layer that is down.
+ * @retval Layer to be re-established next, CONNECTION_LAYER_ONLINE if none.
+ */
+connection_layer_t connection_manager_get_layer(void);
+
+#endif // _CONNECTION_MANAGER_H_
@@ -14,303 +14,1861 @@
 #include "stm32l4xx_hal.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 extern UART_HandleTypeDef huart1;
 
-#define RECEPTION_BUFFER_SIZE   256   /**< Size of reception buffer for UART data */
+/*
+ * A flash page erase in flash_log.c or session_store.c stalls every fetch from flash,
+ * the UART interrupt included, for up to 24.5 ms. ESP8266 keeps sending meanwhile,
+ * about 282 bytes at 115200 baud, and the half of the DMA buffer that is free after
+ * a half transfer event has to hold them, so it must stay above 2 * 282 bytes.
+ */
+#define DMA_RECEPTION_BUFFER_SIZE   1024  /**< Size of circular DMA buffer for UART data, see above */
+#define UART_RECEPTION_BUFFER_SIZE  1024  /**< Size of raw UART reception ring, must be a power of two */
+#define TRANSMIT_QUEUE_SIZE         4096  /**< Size of transmit ring, must be a power of two */
+#define TRANSMIT_FRAME_QUEUE_SIZE   16    /**< Maximum number of queued frames, must divide 256 */
+#define AT_COMMAND_QUEUE_SIZE       8     /**< Maximum number of queued AT commands, must divide 256 */
+#define AT_COMMAND_LENGTH           128   /**< Maximum length of an AT command including terminator */
+#define CIPSEND_PROMPT_TIMEOUT      500   /**< Maximum time to wait for the '>' prompt */
+#define CIPSEND_RESULT_TIMEOUT      5000  /**< Maximum time to wait for SEND OK or SEND FAIL */
+#define RESPONSE_LINE_LENGTH        128   /**< Maximum stored length of a response line */
+#define PASSIVE_RECEIVE_CHUNK       512   /**< Largest AT+CIPRECVDATA read, well below UART_RECEPTION_BUFFER_SIZE */
+#define PASSIVE_RECEIVE_TIMEOUT     1000  /**< Maximum time to wait for AT+CIPRECVDATA data */
+#define PASSTHROUGH_FLUSH_TIMEOUT   1000  /**< Maximum time to wait for queued data before leaving passthrough */
+#define PASSTHROUGH_GUARD_TIME      50    /**< Silence before "+++" so that ESP8266 sees it as a packet of its own */
+#define PASSTHROUGH_EXIT_TIME       1000  /**< Time ESP8266 needs after "+++" before it accepts AT commands */
+
+#define TERMINAL_SEND_OK            0x10  /**< "SEND OK" line, completes AT+CIPSEND payload */
+#define TERMINAL_SEND_FAIL          0x20  /**< "SEND FAIL" line, completes AT+CIPSEND payload */
+
+/**
+ * @brief A queued block of data, consecutive frames of a link share one AT+CIPSEND
+ */
+typedef struct
+{
+    uint16_t length;      /**< Number of bytes in transmit ring */
+    uint8_t link_id;      /**< Link the frame is sent on with multiple connections */
+    uint32_t queued_tick; /**< Time the frame was queued */
+} transmit_frame_t;
+
+/**
+ * @brief State of a link
+ */
+typedef struct
+{
+    bool open;                     /**< Connected, from "CONNECT" until "CLOSED" */
+    ring_buffer_t *reception_ring; /**< Destination of received data, NULL to discard it */
+    bool receive_pending;          /**< ESP8266 may hold received data not read yet, passive receive mode */
+} socket_t;
+
+/**
+ * @brief A queued AT command
+ */
+typedef struct
+{
+    char text[AT_COMMAND_LENGTH];     /**< Command text, DMA source while being sent */
+    uint16_t length;                  /**< Length of command text */
+    uint8_t terminals;                /**< Accepted ESP8266_AT_TERMINAL_x tokens */
+    uint32_t timeout;                 /**< Maximum time to wait for a terminal token */
+    esp8266_at_line_callback_t line_callback; /**< Notified about intermediate response lines, may be NULL */
+    esp8266_at_callback_t callback;   /**< Notified when the command completes, may be NULL */
+    void *context;                    /**< Passed to callback */
+} at_command_t;
+
+/**
+ * @brief A response line recognized by the tokenizer
+ */
+typedef struct
+{
+    const char *text;              /**< Whole line without "\r\n" */
+    uint8_t terminal;              /**< Terminal flag of a final result code, 0 for status lines */
+    esp8266_event_t event;         /**< Event reported for status lines */
+} response_line_t;
+
+/**
+ * @brief States of the response tokenizer
+ */
+typedef enum
+{
+    TOKENIZER_LINE,       /**< Collecting a response line */
+    TOKENIZER_IPD_DATA,   /**< Forwarding the data of a +IPD frame to the reception ring of its link */
+    TOKENIZER_PASSTHROUGH /**< Forwarding every byte to TCP reception ring, transparent transmission */
+} tokenizer_state_t;
+
+/**
+ * @brief States of the UART link to ESP8266
+ */
+typedef enum
+{
+    LINK_STATE_IDLE,          /**< Nothing being sent */
+    LINK_STATE_COMMAND,       /**< AT command sent, waiting for a terminal token */
+    LINK_STATE_SEND_PROMPT,   /**< AT+CIPSEND sent, waiting for prompt */
+    LINK_STATE_SEND_PAYLOAD,  /**< Payload is being transferred by DMA */
+    LINK_STATE_SEND_RESULT,   /**< Payload sent, waiting for SEND OK or SEND FAIL */
+    LINK_STATE_PASSTHROUGH,   /**< Transparent transmission, nothing being sent */
+    LINK_STATE_PASSTHROUGH_PAYLOAD /**< Transparent transmission, queued frames being transferred by DMA */
+} link_state_t;
+
+/**
+ * @brief Steps of a connection operation, each one is an AT command
+ */
+typedef enum
+{
+    OPERATION_STEP_TEST,               /**< AT */
+    OPERATION_STEP_EXIT_PASSTHROUGH,   /**< "+++", a reset of the MCU alone may have left transparent transmission on */
+    OPERATION_STEP_RETEST,             /**< AT after "+++", fails if "+++" was taken as part of it */
+    OPERATION_STEP_RETEST_AGAIN,       /**< AT once more */
+    OPERATION_STEP_NORMAL_MODE,        /**< AT+CIPMODE=0 */
+    OPERATION_STEP_STATION_MODE,       /**< AT+CWMODE=1 */
+    OPERATION_STEP_QUERY_ACCESS_POINT, /**< AT+CWJAP?, associated with the network? */
+    OPERATION_STEP_QUERY_STATUS,       /**< AT+CIPSTATUS, IP address assigned? */
+    OPERATION_STEP_LEAVE,              /**< AT+CWQAP */
+    OPERATION_STEP_JOIN,               /**< AT+CWJAP="<essid>","<password>" */
+    OPERATION_STEP_CLOSE,              /**< AT+CIPCLOSE, do not reuse a socket that may be half open */
+    OPERATION_STEP_CONNECTION_MODE,    /**< AT+CIPMUX */
+    OPERATION_STEP_OPEN,               /**< AT+CIPSTART */
+    OPERATION_STEP_RECEPTION_INFO      /**< AT+CIPDINFO=0 */
+} operation_step_t;
+
+/**
+ * @brief A connection operation run step by step from esp8266_process()
+ */
+typedef struct
+{
+    esp8266_operation_status_t status; /**< Progress of the operation */
+    operation_step_t step;             /**< AT command being executed */
+    bool rejoin;                       /**< Leave and join even if already associated */
+    bool line_matched;                 /**< Query step found the response line it looked for */
+    uint8_t link_id;                   /**< Link opened by the operation */
+    char line_prefix[48];              /**< "+CWJAP:\"<essid>\"," looked for by OPERATION_STEP_QUERY_ACCESS_POINT */
+    char command[AT_COMMAND_LENGTH];   /**< AT+CWJAP or AT+CIPSTART command */
+} operation_t;
+
+static const response_line_t RESPONSE_LINES[] =
+{
+    { "OK",                ESP8266_AT_TERMINAL_OK,    ESP8266_EVENT_NONE },
+    { "ERROR",             ESP8266_AT_TERMINAL_ERROR, ESP8266_EVENT_NONE },
+    { "FAIL",              ESP8266_AT_TERMINAL_FAIL,  ESP8266_EVENT_NONE },
+    { "SEND OK",           TERMINAL_SEND_OK,          ESP8266_EVENT_NONE },
+    { "SEND FAIL",         TERMINAL_SEND_FAIL,        ESP8266_EVENT_NONE },
+    { "WIFI CONNECTED",    0,                         ESP8266_EVENT_WIFI_CONNECTED },
+    { "WIFI GOT IP",       0,                         ESP8266_EVENT_WIFI_GOT_IP },
+    { "WIFI DISCONNECT",   0,                         ESP8266_EVENT_WIFI_DISCONNECTED },
+    { "CONNECT",           0,                         ESP8266_EVENT_TCP_CONNECTED },
+    { "ALREADY CONNECTED", 0,                         ESP8266_EVENT_TCP_CONNECTED },
+    { "CLOSED",            0,                         ESP8266_EVENT_TCP_CLOSED },
+};
+
+static const char IPD_PREFIX[] = "+IPD,";
+static const char RECEIVE_DATA_PREFIX[] = "+CIPRECVDATA,";
+
+static uint8_t s_uart_reception_storage[UART_RECEPTION_BUFFER_SIZE]; /**< UART reception ring storage */
+static ring_buffer_t s_uart_reception_ring = RING_BUFFER_STATIC_INIT(s_uart_reception_storage); /**< Raw UART bytes, filled from UART ISR */
+static uint8_t s_reception_storage[RECEPTION_BUFFER_SIZE]; /**< TCP reception ring storage */
+ring_buffer_t g_reception_ring = RING_BUFFER_STATIC_INIT(s_reception_storage); /**< TCP data received from server */
+static socket_t s_sockets[ESP8266_LINK_COUNT] =
+{
+    [ESP8266_PRIMARY_LINK] = { false, &g_reception_ring, false }
+};
+
+static uint8_t s_transmit_storage[TRANSMIT_QUEUE_SIZE]; /**< Transmit ring storage */
+static ring_buffer_t s_transmit_ring = RING_BUFFER_STATIC_INIT(s_transmit_storage); /**< Transmit ring, drained by DMA */
+static transmit_frame_t s_transmit_frames[TRANSMIT_FRAME_QUEUE_SIZE]; /**< Frame boundaries in transmit ring */
+static uint8_t s_transmit_frame_head = 0;            /**< Free-running index of next frame to queue */
+static uint8_t s_transmit_frame_tail = 0;            /**< Free-running index of frame being sent */
+
+static at_command_t s_at_commands[AT_COMMAND_QUEUE_SIZE]; /**< AT command queue */
+static uint8_t s_at_command_head = 0;                /**< Free-running index of next command to queue */
+static uint8_t s_at_command_tail = 0;                /**< Free-running index of command being executed */
+
+static link_state_t s_link_state = LINK_STATE_IDLE;  /**< State of the UART link */
+static uint32_t s_link_state_tick = 0;               /**< Tick of the last state change */
+static uint8_t s_wait_terminals = 0;                 /**< Terminals accepted by the current request */
+static uint8_t s_matched_terminal = 0;               /**< First accepted terminal received, 0 if none */
+static esp8266_send_callback_t s_send_callback = NULL; /**< Notified about the result of each frame */
+static esp8266_event_callback_t s_event_callback = NULL; /**< Notified about status lines */
+
+static tokenizer_state_t s_tokenizer_state = TOKENIZER_LINE; /**< State of the response tokenizer */
+static char s_response_line[RESPONSE_LINE_LENGTH];   /**< Response line being collected */
+static uint16_t s_response_line_length = 0;          /**< Length of collected response line */
+static uint32_t s_ipd_remaining = 0;                 /**< Bytes of current +IPD data left to forward */
+static ring_buffer_t *s_ipd_ring = NULL;             /**< Destination of current +IPD data, NULL to discard it */
+static char s_send_command[24] = { 0 };              /**< AT+CIPSEND command, DMA source */
+static volatile bool s_dma_transmit_busy = false;    /**< DMA transmission in progress */
+static volatile uint32_t s_dma_transmit_length = 0;  /**< Bytes of current DMA transfer taken from transmit ring */
+static volatile uint32_t s_payload_remaining = 0;    /**< Payload bytes of current frame not sent yet */
+static uint8_t s_sending_frames = 0;                 /**< Frames in the current AT+CIPSEND or passthrough transfer */
+static uint32_t s_sending_length = 0;                /**< Total length of those frames */
+static uint32_t s_transmit_linger = ESP8266_TRANSMIT_LINGER; /**< Time a frame waits for others to share its AT+CIPSEND */
+static bool s_flushing = false;                      /**< esp8266_flush_transmit() running, no lingering */
+static bool s_passive_receive = false;               /**< ESP8266 keeps received data until read with AT+CIPRECVDATA */
+static bool s_receive_requested = false;             /**< AT+CIPRECVDATA queued or running */
+static uint8_t s_receive_link = ESP8266_PRIMARY_LINK; /**< Link read by the running AT+CIPRECVDATA */
+static uint32_t s_receive_requested_length = 0;      /**< Length asked for by the running AT+CIPRECVDATA */
+static uint32_t s_receive_length = 0;                /**< Length returned by the running AT+CIPRECVDATA */
+static bool s_multiple_connections = false;          /**< AT+CIPMUX=1 selected */
+static bool s_connection_mode_applied = false;       /**< AT+CIPMUX matching s_multiple_connections was accepted */
+static operation_t s_operation;                      /**< Connection operation, one at a time, ESP8266_OPERATION_IDLE at start */
+
+static uint8_t s_dma_reception_buffer[DMA_RECEPTION_BUFFER_SIZE]; /**< Circular DMA reception buffer */
+static uint16_t s_dma_read_position = 0;             /**< Position of the next unprocessed byte in DMA buffer */
+
+/**
+ * @brief Initial AT command to test ESP8266 connectivity
+ */
+static const char INTIAL_COMMAND[] = "AT\r\n";
+
+/**
+ * @brief Command to set ESP8266 to station mode
+ */
+static const char SET_STATION_MODE_COMMAND[] = "AT+CWMODE=1\r\n";
+
+/**
+ * @brief Command to disconnect from currently connected Wi-Fi
+ */
+static const char DISCONNECT_FROM_WIFI_COMMAND[] = "AT+CWQAP\r\n";
+
+/**
+ * @brief Command to query the access point ESP8266 is associated with
+ */
+static const char QUERY_ACCESS_POINT_COMMAND[] = "AT+CWJAP?\r\n";
+
+/**
+ * @brief Command to query whether ESP8266 has an IP address
+ */
+static const char QUERY_STATUS_COMMAND[] = "AT+CIPSTATUS\r\n";
+
+/**
+ * @brief Command to start single connection mode
+ */
+static const char START_SINGLE_CONNECTION_COMMAND[] = "AT+CIPMUX=0\r\n";
+
+/**
+ * @brief Command to start multiple connection mode, links 0 to 4
+ */
+static const char START_MULTIPLE_CONNECTION_COMMAND[] = "AT+CIPMUX=1\r\n";
+
+/**
+ * @brief Command to close the TCP connection
+ */
+static const char CLOSE_CONNECTION_COMMAND[] = "AT+CIPCLOSE\r\n";
+
+/**
+ * @brief Command to select transparent transmission
+ */
+static const char PASSTHROUGH_MODE_COMMAND[] = "AT+CIPMODE=1\r\n";
+
+/**
+ * @brief Command to select normal transmission, one AT+CIPSEND per buffer
+ */
+static const char NORMAL_MODE_COMMAND[] = "AT+CIPMODE=0\r\n";
+
+/**
+ * @brief Command to start transparent transmission, answered with the prompt
+ */
+static const char START_PASSTHROUGH_COMMAND[] = "AT+CIPSEND\r\n";
+
+/**
+ * @brief Command to keep received data in ESP8266 until it is read
+ */
+static const char PASSIVE_RECEIVE_COMMAND[] = "AT+CIPRECVMODE=1\r\n";
+
+/**
+ * @brief Command to forward received data with +IPD as soon as it arrives
+ */
+static const char ACTIVE_RECEIVE_COMMAND[] = "AT+CIPRECVMODE=0\r\n";
+
+/**
+ * @brief Sequence that ends transparent transmission
+ */
+static const char EXIT_PASSTHROUGH_SEQUENCE[] = "+++";
+
+/**
+ * @brief Command to enable reception info
+ */
+static const char ENABLE_RECEPTION_COMMNAD []  = "AT+CIPDINFO=0\r\n" ;
+
+/**
+ * @brief Result of a command executed with run_command()
+ */
+typedef struct
+{
+    bool completed;               /**< Command completed */
+    esp8266_at_result_t result;   /**< Result of the command */
+} blocking_command_t;
+
+/**
+ * @brief Starts circular DMA reception with idle-line detection
+ * 
+ * The DMA keeps writing into s_dma_reception_buffer without CPU involvement;
+ * HAL_UARTEx_RxEventCallback is raised on half/full transfer and whenever
+ * the line goes idle, so each burst from ESP8266 is handed over at once.
+ */
+static void start_reception(void)
+{
+    if (huart1.RxState != HAL_UART_STATE_READY)
+    {
+        return; // Already running, restarting would lose the DMA read position
+    }
+    s_dma_read_position = 0;
+    HAL_UARTEx_ReceiveToIdle_DMA(&huart1, s_dma_reception_buffer, sizeof(s_dma_reception_buffer));
+}
+
+/**
+ * @brief Completion callback of run_command()
+ * 
+ * @param result Result of the command
+ * @param context Pointer to blocking_command_t
+ */
+static void on_blocking_command_complete(esp8266_at_result_t result, void *context)
+{
+    blocking_command_t *blocking = (blocking_command_t*) context;
+    blocking->result = result;
+    blocking->completed = true;
+}
+
+/**
+ * @brief Executes an AT command and waits until it completes
+ * 
+ * Returns as soon as OK, ERROR or FAIL is received instead of sleeping
+ * for the whole timeout. Fails at once during transparent transmission,
+ * where queued commands are not sent and the wait would never end.
+ * 
+ * @param command Command text including "\r\n"
+ * @param timeout_in_millisecond Maximum time to wait for the result
+ * @return Result of the command
+ */
+static esp8266_at_result_t run_command(const char *command, uint32_t timeout_in_millisecond)
+{
+    if (s_tokenizer_state == TOKENIZER_PASSTHROUGH)
+    {
+        return ESP8266_AT_ERROR;
+    }
+    blocking_command_t blocking = { false, ESP8266_AT_TIMEOUT };
+    if (esp8266_at_submit(command, ESP8266_AT_TERMINAL_OK | ESP8266_AT_TERMINAL_ERROR | ESP8266_AT_TERMINAL_FAIL,
+                          timeout_in_millisecond, on_blocking_command_complete, &blocking) != true)
+    {
+        return ESP8266_AT_ERROR;
+    }
+    while (blocking.completed != true)
+    {
+        esp8266_process();
+    }
+    return blocking.result;
+}
+
+/**
+ * @brief Response line callback of AT+CWJAP?
+ * 
+ * @param line Response line, "+CWJAP:\"<essid>\",..." while associated
+ * @param context Pointer to operation_t
+ */
+static void on_access_point_line(const char *line, void *context)
+{
+    operation_t *operation = (operation_t*) context;
+    if (strncmp(line, operation->line_prefix, strlen(operation->line_prefix)) == 0)
+    {
+        operation->line_matched = true;
+    }
+}
+
+/**
+ * @brief Response line callback of AT+CIPSTATUS
+ * 
+ * @param line Response line, "STATUS:<stat>" with 2, 3 or 4 once an IP address is assigned
+ * @param context Pointer to operation_t
+ */
+static void on_status_line(const char *line, void *context)
+{
+    if (strncmp(line, "STATUS:", 7) == 0 && line[7] >= '2' && line[7] <= '4')
+    {
+        ((operation_t*) context)->line_matched = true;
+    }
+}
+
+/**
+ * @brief Response line callback of AT+CIPSTART
+ * 
+ * @param line Response line
+ * @param context Pointer to operation_t
+ */
+static void on_connect_line(const char *line, void *context)
+{
+    if (strcmp(line, "ALREADY CONNECTED") == 0)
+    {
+        ((operation_t*) context)->line_matched = true;
+    }
+}
+
+/**
+ * @brief Disconnects ESP8266 from currently connected Wi-Fi
+ */
+static void disconnect_from_wifi(void)
+{
+    run_command(DISCONNECT_FROM_WIFI_COMMAND, 1000);
+}
+
+/**
+ * @brief Closes the connection on a link, errors are ignored
+ * 
+ * @param link_id Link ID, ignored in single connection mode
+ */
+static void close_connection(uint8_t link_id)
+{
+    char command[24];
+    if (s_multiple_connections)
+    {
+        snprintf(command, sizeof(command), "AT+CIPCLOSE=%u\r\n", link_id);
+        run_command(command, 2000);
+    }
+    else
+    {
+        run_command(CLOSE_CONNECTION_COMMAND, 2000);
+    }
+    s_sockets[link_id].open = false;
+    s_sockets[link_id].receive_pending = false;
+}
+
+static void on_operation_step_complete(esp8266_at_result_t result, void *context);
+
+/**
+ * @brief Ends the connection operation
+ * 
+ * @param success true if the operation succeeded
+ */
+static void finish_operation(bool success)
+{
+    s_operation.status = success ? ESP8266_OPERATION_SUCCEEDED : ESP8266_OPERATION_FAILED;
+}
+
+/**
+ * @brief Queues the AT command of a step of the connection operation
+ * 
+ * @param step Step to execute
+ */
+static void start_operation_step(operation_step_t step)
+{
+    static const uint8_t terminals = ESP8266_AT_TERMINAL_OK | ESP8266_AT_TERMINAL_ERROR | ESP8266_AT_TERMINAL_FAIL;
+    char close_command[24];
+    bool queued;
+
+    if (step == OPERATION_STEP_CONNECTION_MODE && s_connection_mode_applied)
+    {
+        step = OPERATION_STEP_OPEN;
+    }
+    s_operation.step = step;
+    s_operation.line_matched = false;
+
+    switch (step)
+    {
+    case OPERATION_STEP_TEST:
+    case OPERATION_STEP_RETEST:
+    case OPERATION_STEP_RETEST_AGAIN:
+        queued = esp8266_at_submit(INTIAL_COMMAND, terminals, 1000, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_EXIT_PASSTHROUGH:
+        // No terminal, the command lasts its timeout. The failed AT before it provided the guard time.
+        queued = esp8266_at_submit(EXIT_PASSTHROUGH_SEQUENCE, 0, PASSTHROUGH_EXIT_TIME, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_NORMAL_MODE:
+        queued = esp8266_at_submit(NORMAL_MODE_COMMAND, terminals, 1000, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_STATION_MODE:
+        queued = esp8266_at_submit(SET_STATION_MODE_COMMAND, terminals, 1000, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_QUERY_ACCESS_POINT:
+        queued = esp8266_at_submit_query(QUERY_ACCESS_POINT_COMMAND, terminals, 1000,
+                                         on_access_point_line, on_operation_step_complete, &s_operation);
+        break;
+
+    case OPERATION_STEP_QUERY_STATUS:
+        queued = esp8266_at_submit_query(QUERY_STATUS_COMMAND, terminals, 1000,
+                                         on_status_line, on_operation_step_complete, &s_operation);
+        break;
+
+    case OPERATION_STEP_LEAVE:
+        queued = esp8266_at_submit(DISCONNECT_FROM_WIFI_COMMAND, terminals, 1000, on_operation_step_complete, NULL);
+        break;
 
-uint8_t g_reception_buffer[RECEPTION_BUFFER_SIZE];  /**< Reception buffer */
-uint16_t s_reception_buffer_index = 0;              /**< Reception buffer index */
+    case OPERATION_STEP_JOIN:
+        queued = esp8266_at_submit(s_operation.command, terminals, 20000, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_CLOSE:
+        if (s_multiple_connections)
+        {
+            snprintf(close_command, sizeof(close_command), "AT+CIPCLOSE=%u\r\n", s_operation.link_id);
+        }
+        else
+        {
+            strcpy(close_command, CLOSE_CONNECTION_COMMAND);
+        }
+        queued = esp8266_at_submit(close_command, terminals, 2000, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_CONNECTION_MODE:
+        queued = esp8266_at_submit(s_multiple_connections ? START_MULTIPLE_CONNECTION_COMMAND : START_SINGLE_CONNECTION_COMMAND,
+                                   terminals, 1000, on_operation_step_complete, NULL);
+        break;
+
+    case OPERATION_STEP_OPEN:
+        queued = esp8266_at_submit_query(s_operation.command, terminals, 5000,
+                                         on_connect_line, on_operation_step_complete, &s_operation);
+        break;
+
+    case OPERATION_STEP_RECEPTION_INFO:
+    default:
+        queued = esp8266_at_submit(ENABLE_RECEPTION_COMMNAD, terminals, 2000, on_operation_step_complete, NULL);
+        break;
+    }
+
+    if (!queued)
+    {
+        finish_operation(false);
+    }
+}
+
+/**
+ * @brief Completion callback of every step of the connection operation, starts the next one
+ * 
+ * @param result Result of the step
+ * @param context Unused
+ */
+static void on_operation_step_complete(esp8266_at_result_t result, void *context)
+{
+    bool ok = (result == ESP8266_AT_OK);
+    switch (s_operation.step)
+    {
+    case OPERATION_STEP_TEST:
+        if (ok)
+        {
+            start_operation_step(OPERATION_STEP_STATION_MODE);
+        }
+        else if (result == ESP8266_AT_TIMEOUT)
+        {
+            start_operation_step(OPERATION_STEP_EXIT_PASSTHROUGH); // Still booting or in transparent transmission
+        }
+        else
+        {
+            finish_operation(false);
+        }
+        break;
+
+    case OPERATION_STEP_EXIT_PASSTHROUGH:
+        start_operation_step(OPERATION_STEP_RETEST);
+        break;
+
+    case OPERATION_STEP_RETEST:
+        start_operation_step(ok ? OPERATION_STEP_NORMAL_MODE : OPERATION_STEP_RETEST_AGAIN);
+        break;
+
+    case OPERATION_STEP_RETEST_AGAIN:
+        if (ok)
+        {
+            start_operation_step(OPERATION_STEP_NORMAL_MODE);
+        }
+        else
+        {
+            finish_operation(false);
+        }
+        break;
+
+    case OPERATION_STEP_NORMAL_MODE:
+        start_operation_step(OPERATION_STEP_STATION_MODE);
+        break;
+
+    case OPERATION_STEP_STATION_MODE:
+        if (ok)
+        {
+            start_operation_step(s_operation.rejoin ? OPERATION_STEP_LEAVE : OPERATION_STEP_QUERY_ACCESS_POINT);
+        }
+        else
+        {
+            finish_operation(false);
+        }
+        break;
+
+    case OPERATION_STEP_QUERY_ACCESS_POINT:
+        start_operation_step((ok && s_operation.line_matched) ? OPERATION_STEP_QUERY_STATUS : OPERATION_STEP_LEAVE);
+        break;
+
+    case OPERATION_STEP_QUERY_STATUS:
+        if (ok && s_operation.line_matched)
+        {
+            finish_operation(true); // Association kept across a reset of the MCU, no AT+CWJAP needed
+        }
+        else
+        {
+            start_operation_step(OPERATION_STEP_LEAVE);
+        }
+        break;
+
+    case OPERATION_STEP_LEAVE:
+        start_operation_step(OPERATION_STEP_JOIN);
+        break;
+
+    case OPERATION_STEP_CLOSE:
+        s_sockets[s_operation.link_id].open = false;
+        s_sockets[s_operation.link_id].receive_pending = false;
+        start_operation_step(OPERATION_STEP_CONNECTION_MODE);
+        break;
+
+    case OPERATION_STEP_CONNECTION_MODE:
+        s_connection_mode_applied = ok;
+        if (ok)
+        {
+            start_operation_step(OPERATION_STEP_OPEN);
+        }
+        else
+        {
+            finish_operation(false);
+        }
+        break;
+
+    case OPERATION_STEP_OPEN:
+        // A socket left open by an earlier run is reported as ERROR, but it is usable
+        if (ok || s_operation.line_matched)
+        {
+            s_sockets[s_operation.link_id].open = true;
+            start_operation_step(OPERATION_STEP_RECEPTION_INFO);
+        }
+        else
+        {
+            s_connection_mode_applied = false; // ESP8266 may have been reset to its default mode
+            finish_operation(false);
+        }
+        break;
+
+    case OPERATION_STEP_JOIN:
+    case OPERATION_STEP_RECEPTION_INFO:
+    default:
+        finish_operation(ok);
+        break;
+    }
+}
+
+/**
+ * @brief Starts an operation that opens a connection on a link
+ * 
+ * @param link_id Link ID, ignored in single connection mode
+ * @param type "TCP" or "UDP"
+ * @param ip_address IP address of remote host
+ * @param port_number Port number of remote host
+ * @param close_first true to close the link before opening it
+ * @return true if started, false if another operation is running
+ */
+static bool start_open_operation(uint8_t link_id, const char *type, const char *ip_address, int port_number,
+                                 bool close_first)
+{
+    if (s_operation.status == ESP8266_OPERATION_RUNNING)
+    {
+        return false;
+    }
+    esp8266_stop_passthrough();
+    if (s_multiple_connections)
+    {
+        snprintf(s_operation.command, sizeof(s_operation.command), "AT+CIPSTART=%u,\"%s\",\"%s\",%d\r\n",
+                 link_id, type, ip_address, port_number);
+    }
+    else
+    {
+        snprintf(s_operation.command, sizeof(s_operation.command), "AT+CIPSTART=\"%s\",\"%s\",%d\r\n",
+                 type, ip_address, port_number);
+    }
+    s_operation.link_id = link_id;
+    s_operation.status = ESP8266_OPERATION_RUNNING;
+    start_operation_step(close_first ? OPERATION_STEP_CLOSE : OPERATION_STEP_CONNECTION_MODE);
+    return true;
+}
+
+/**
+ * @brief Runs esp8266_process() until the connection operation ends
+ * 
+ * @return true if the operation succeeded, false otherwise
+ */
+static bool wait_for_operation(void)
+{
+    while (s_operation.status == ESP8266_OPERATION_RUNNING)
+    {
+        esp8266_process();
+    }
+    return s_operation.status == ESP8266_OPERATION_SUCCEEDED;
+}
+
+/**
+ * @brief Starts a DMA transmission
+ * 
+ * @param data Pointer to data, must stay valid until transmission completes
+ * @param length Number of bytes to transmit
+ * @param ring_bytes Number of those bytes taken from transmit ring
+ * @return true if transmission started, false otherwise
+ */
+static bool start_dma_transmit(const uint8_t *data, uint16_t length, uint32_t ring_bytes)
+{
+    s_dma_transmit_length = ring_bytes;
+    s_dma_transmit_busy = true;
+    if (HAL_UART_Transmit_DMA(&huart1, data, length) != HAL_OK)
+    {
+        s_dma_transmit_length = 0;
+        s_dma_transmit_busy = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Sends "+++" with the pauses ESP8266 needs to leave transparent transmission
+ * 
+ * Blocks for about PASSTHROUGH_EXIT_TIME. In command mode "+++" becomes
+ * part of the next command, which then fails.
+ */
+static void send_exit_passthrough_sequence(void)
+{
+    while (s_dma_transmit_busy)
+    {
+    }
+
+    HAL_Delay(PASSTHROUGH_GUARD_TIME);
+    s_payload_remaining = 0;
+    if (start_dma_transmit((const uint8_t*) EXIT_PASSTHROUGH_SEQUENCE, sizeof(EXIT_PASSTHROUGH_SEQUENCE) - 1, 0))
+    {
+        while (s_dma_transmit_busy)
+        {
+        }
+    }
+    HAL_Delay(PASSTHROUGH_EXIT_TIME);
+}
+
+/**
+ * @brief Starts connecting to Wi-Fi network, progress is made by esp8266_process()
+ * 
+ * An association with the same network that has an IP address is reused,
+ * so a reset of the MCU alone costs a few short queries instead of a join.
+ * 
+ * @param essid Wi-Fi ESSID
+ * @param password Wi-Fi password
+ * @param rejoin true to leave and join even if already associated
+ * @return true if started, false if another operation is running or the parameters are too long
+ */
+bool esp8266_start_network_connect(const char *essid, const char *password, bool rejoin)
+{
+    if (s_operation.status == ESP8266_OPERATION_RUNNING ||
+        snprintf(s_operation.line_prefix, sizeof(s_operation.line_prefix), "+CWJAP:\"%s\",", essid) >=
+            (int) sizeof(s_operation.line_prefix) ||
+        snprintf(s_operation.command, sizeof(s_operation.command), "AT+CWJAP=\"%s\",\"%s\"\r\n", essid, password) >=
+            (int) sizeof(s_operation.command))
+    {
+        return false;
+    }
+    esp8266_stop_passthrough();
+    s_connection_mode_applied = false;
+    start_reception();
+    clear_reception_buffer();
+
+    s_operation.rejoin = rejoin;
+    s_operation.status = ESP8266_OPERATION_RUNNING;
+    start_operation_step(OPERATION_STEP_TEST);
+    return true;
+}
+
+/**
+ * @brief Starts reopening the connection to TCP server, progress is made by esp8266_process()
+ * 
+ * The link is closed first, so that a half-open socket is not reused.
+ * 
+ * @param ip_address IP address of TCP server
+ * @param port_number Port number of TCP server
+ * @return true if started, false if another operation is running
+ */
+bool esp8266_start_tcp_connect(const char *ip_address, int port_number)
+{
+    return start_open_operation(ESP8266_PRIMARY_LINK, "TCP", ip_address, port_number, true);
+}
+
+/**
+ * @brief Reports the progress of the last connection operation
+ * 
+ * @return Status of the operation started last
+ */
+esp8266_operation_status_t esp8266_operation_status(void)
+{
+    return s_operation.status;
+}
+
+/**
+ * @brief Connects STM32 to Wi-Fi network
+ * 
+ * @param essid Wi-Fi ESSID
+ * @param password Wi-Fi password
+ * @return true if connection successful, false otherwise
+ */
+bool connect_to_network(const char* essid, const char *password)
+{
+    return esp8266_start_network_connect(essid, password, false) && wait_for_operation();
+}
+
+/**
+ * @brief Disconnects STM32 from Wi-Fi network
+ */
+void disconnect_from_network(void)
+{
+    esp8266_stop_passthrough();
+    disconnect_from_wifi();
+}
+
+/**
+ * @brief Connects STM32 to TCP server
+ * 
+ * @param ip_address IP address of TCP server
+ * @param port_number Port number of TCP server
+ * @return true if connection successful, false otherwise
+ */
+bool connect_to_tcp_server(const char *ip_address, int port_number)
+{
+    return start_open_operation(ESP8266_PRIMARY_LINK, "TCP", ip_address, port_number, false) && wait_for_operation();
+}
+
+/**
+ * @brief Closes the connection to TCP server
+ * 
+ * Used before reconnecting so that a half-open socket is not reused.
+ */
+void disconnect_from_tcp_server(void)
+{
+    esp8266_stop_passthrough();
+    close_connection(ESP8266_PRIMARY_LINK);
+}
+
+/**
+ * @brief Hands the next contiguous part of current frame to DMA
+ * 
+ * Called from main loop for the first part and from transmit complete
+ * interrupt when the frame wraps around the end of transmit ring.
+ * 
+ * @return true if transmission started, false otherwise
+ */
+static bool transmit_next_payload_part(void)
+{
+    const uint8_t *data;
+    uint32_t length = ring_buffer_peek_linear(&s_transmit_ring, &data);
+    if (length > s_payload_remaining)
+    {
+        length = s_payload_remaining;
+    }
+    return start_dma_transmit(data, length, length);
+}
+
+/**
+ * @brief Sends a request to ESP8266 and starts tracking its response
+ * 
+ * @param data Pointer to request, must stay valid until transmission completes
+ * @param length Length of request
+ * @param next_state Link state to enter once the request is being sent
+ * @param terminals Terminal flags that complete the request
+ */
+static void send_request(const char *data, uint16_t length, link_state_t next_state, uint8_t terminals)
+{
+    if (start_dma_transmit((const uint8_t*) data, length, 0))
+    {
+        s_wait_terminals = terminals;
+        s_matched_terminal = 0;
+        s_link_state_tick = HAL_GetTick();
+        s_link_state = next_state;
+    }
+}
+
+/**
+ * @brief Continues waiting on the same response for other terminal tokens
+ * 
+ * @param terminals Terminal flags that complete the next phase
+ */
+static void wait_for_terminals(uint8_t terminals)
+{
+    s_wait_terminals = terminals;
+    s_matched_terminal = 0;
+}
+
+/**
+ * @brief Looks up a known response line
+ * 
+ * @param line Response line without "\r\n"
+ * @return Pointer to the table entry, NULL if the line is not known
+ */
+static const response_line_t *find_response_line(const char *line)
+{
+    for (uint8_t i = 0; i < sizeof(RESPONSE_LINES) / sizeof(RESPONSE_LINES[0]); i++)
+    {
+        if (strcmp(line, RESPONSE_LINES[i].text) == 0)
+        {
+            return &RESPONSE_LINES[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the link a +IPD frame or line refers to
+ * 
+ * @param field Pointer to the first field after "+IPD,"
+ * @param end Set to the field following the link ID
+ * @return Link ID, ESP8266_PRIMARY_LINK in single connection mode
+ */
+static uint8_t parse_ipd_link(const char *field, const char **end)
+{
+    *end = field;
+    if (!s_multiple_connections)
+    {
+        return ESP8266_PRIMARY_LINK;
+    }
+    char *next;
+    uint32_t link_id = strtoul(field, &next, 10);
+    *end = (*next == ',') ? next + 1 : next;
+    return (link_id < ESP8266_LINK_COUNT) ? link_id : ESP8266_LINK_COUNT;
+}
+
+/**
+ * @brief Handles a complete response line
+ * 
+ * Lines are compared as a whole, so command echo, unsolicited status lines
+ * and their order do not affect the result of a command. With multiple
+ * connections status lines carry the link ID, "<id>,CONNECT", and only
+ * those of ESP8266_PRIMARY_LINK are reported as events.
+ * 
+ * @param line Response line without "\r\n"
+ * @return Terminal flag of a final result code, 0 for other lines
+ */
+static uint8_t handle_response_line(const char *line)
+{
+    if (s_passive_receive && strncmp(line, IPD_PREFIX, sizeof(IPD_PREFIX) - 1) == 0)
+    {
+        const char *end;
+        uint8_t link_id = parse_ipd_link(line + sizeof(IPD_PREFIX) - 1, &end);
+        if (link_id < ESP8266_LINK_COUNT)
+        {
+            s_sockets[link_id].receive_pending = true; // Data waits in ESP8266 until read with AT+CIPRECVDATA
+        }
+        return 0;
+    }
+
+    uint8_t link_id = ESP8266_PRIMARY_LINK;
+    bool link_line = !s_multiple_connections; // Unnumbered lines refer to the only link
+    const response_line_t *response = find_response_line(line);
+    if (response == NULL && s_multiple_connections &&
+        line[0] >= '0' && line[0] < '0' + ESP8266_LINK_COUNT && line[1] == ',')
+    {
+        response = find_response_line(&line[2]);
+        link_id = line[0] - '0';
+        link_line = true;
+    }
+
+    if (response != NULL)
+    {
+        if (link_line && response->event == ESP8266_EVENT_TCP_CONNECTED)
+        {
+            s_sockets[link_id].open = true;
+        }
+        else if (link_line && response->event == ESP8266_EVENT_TCP_CLOSED)
+        {
+            s_sockets[link_id].open = false;
+            s_sockets[link_id].receive_pending = false;
+        }
+        if (response->event != ESP8266_EVENT_NONE && link_id == ESP8266_PRIMARY_LINK && s_event_callback != NULL)
+        {
+            s_event_callback(response->event);
+        }
+        if (response->terminal != 0)
+        {
+            return response->terminal;
+        }
+    }
+
+    if (s_link_state == LINK_STATE_COMMAND)
+    {
+        const at_command_t *command = &s_at_commands[s_at_command_tail % AT_COMMAND_QUEUE_SIZE];
+        if (command->line_callback != NULL)
+        {
+            command->line_callback(line, command->context);
+        }
+    }
+    return 0;
+}
 
-static uint8_t s_reception_byte;                    /**< Single byte reception variable */
-static char s_dynamic_command[128] = { 0 };          /**< Dynamic command buffer */
-static char s_dynamic_command_response[128] = { 0 }; /**< Dynamic command response buffer */
+/**
+ * @brief Tells whether the response line collected so far starts with a prefix
+ * 
+ * @param prefix Prefix string
+ * @param length Length of prefix
+ * @return true if the line is longer than the prefix and starts with it
+ */
+static bool line_starts_with(const char *prefix, size_t length)
+{
+    return s_response_line_length > length && memcmp(s_response_line, prefix, length) == 0;
+}
 
-/** 
- * @brief Initial AT command to test ESP8266 connectivity
+/**
+ * @brief Feeds one received byte outside of +IPD data to the response tokenizer
+ * 
+ * @param byte Received byte
+ * @return Terminal flag completed by the byte, 0 if none
  */
-static const char INTIAL_COMMAND[] = "AT\r\n";
-#define INITIAL_COMMAND_RESPONSE "AT\r\r\n\r\nOK\r\n"
+static uint8_t tokenize_byte(uint8_t byte)
+{
+    if (byte == '>' && s_response_line_length == 0)
+    {
+        return ESP8266_AT_TERMINAL_PROMPT;
+    }
 
-/** 
- * @brief Command to set ESP8266 to station mode
+    if (byte == '\n')
+    {
+        while (s_response_line_length > 0 && s_response_line[s_response_line_length - 1] == '\r')
+        {
+            s_response_line_length--;
+        }
+        s_response_line[s_response_line_length] = '\0';
+        uint16_t line_length = s_response_line_length;
+        s_response_line_length = 0;
+        return (line_length > 0) ? handle_response_line(s_response_line) : 0;
+    }
+
+    bool passive_data = (byte == ':') && line_starts_with(RECEIVE_DATA_PREFIX, sizeof(RECEIVE_DATA_PREFIX) - 1);
+    if (passive_data || (byte == ':' && line_starts_with(IPD_PREFIX, sizeof(IPD_PREFIX) - 1)))
+    {
+        // "+IPD,[<id>,]<length>:" and "+CIPRECVDATA,<length>:" are both followed by the data
+        s_response_line[s_response_line_length] = '\0';
+        s_response_line_length = 0;
+        const char *field = strchr(s_response_line, ',') + 1;
+        uint8_t link_id = passive_data ? s_receive_link : parse_ipd_link(field, &field);
+        s_ipd_remaining = strtoul(field, NULL, 10);
+        s_ipd_ring = (link_id < ESP8266_LINK_COUNT) ? s_sockets[link_id].reception_ring : NULL;
+        if (passive_data)
+        {
+            s_receive_length = s_ipd_remaining;
+        }
+        if (s_ipd_remaining > 0)
+        {
+            s_tokenizer_state = TOKENIZER_IPD_DATA;
+        }
+        return 0;
+    }
+
+    if (s_response_line_length < sizeof(s_response_line) - 1)
+    {
+        s_response_line[s_response_line_length++] = byte;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decodes the bytes received since the previous call
+ * 
+ * Response lines are tokenized byte by byte, while the data of +IPD frames
+ * is copied in blocks to the reception ring of its link, so the MQTT layer
+ * only sees the TCP byte stream. In transparent transmission every byte is
+ * TCP data. Stops at the first terminal accepted by the current request,
+ * so that the bytes after it are attributed to the next request.
  */
-static const char SET_STATION_MODE_COMMAND[] = "AT+CWMODE=1\r\n";
-#define SET_STATION_MODE_COMMAND_RESPONSE "AT+CWMODE=1\r\r\n\r\nOK\r\n"
+static void process_reception(void)
+{
+    const uint8_t *data;
+    uint32_t length;
+    while (s_matched_terminal == 0 && (length = ring_buffer_peek_linear(&s_uart_reception_ring, &data)) > 0)
+    {
+        if (s_tokenizer_state == TOKENIZER_PASSTHROUGH)
+        {
+            ring_buffer_write(&g_reception_ring, data, length);
+            ring_buffer_discard(&s_uart_reception_ring, length);
+            continue;
+        }
+        if (s_tokenizer_state == TOKENIZER_IPD_DATA)
+        {
+            if (length > s_ipd_remaining)
+            {
+                length = s_ipd_remaining;
+            }
+            if (s_ipd_ring != NULL)
+            {
+                ring_buffer_write(s_ipd_ring, data, length);
+            }
+            ring_buffer_discard(&s_uart_reception_ring, length);
+            s_ipd_remaining -= length;
+            if (s_ipd_remaining == 0)
+            {
+                s_tokenizer_state = TOKENIZER_LINE;
+            }
+            continue;
+        }
 
-/** 
- * @brief Command to disconnect from currently connected Wi-Fi
+        ring_buffer_discard(&s_uart_reception_ring, 1);
+        uint8_t terminal = tokenize_byte(data[0]);
+        if ((terminal & s_wait_terminals) != 0)
+        {
+            s_matched_terminal = terminal;
+        }
+    }
+}
+
+/**
+ * @brief Converts a terminal flag to the result reported to the command
+ * 
+ * @param terminal Terminal flag
+ * @return Result of the command
  */
-static const char DISCONNECT_FROM_WIFI_COMMAND[] = "AT+CWQAP\r\n";
+static esp8266_at_result_t terminal_to_result(uint8_t terminal)
+{
+    switch (terminal)
+    {
+    case ESP8266_AT_TERMINAL_OK:
+        return ESP8266_AT_OK;
+    case ESP8266_AT_TERMINAL_FAIL:
+        return ESP8266_AT_FAIL;
+    case ESP8266_AT_TERMINAL_PROMPT:
+        return ESP8266_AT_PROMPT;
+    default:
+        return ESP8266_AT_ERROR;
+    }
+}
 
-/** 
- * @brief Command to start single connection mode
+/**
+ * @brief Finishes the AT command being executed and reports the result
+ * 
+ * @param result Result of the command
  */
-static const char START_SINGLE_CONNECTION_COMMAND[] = "AT+CIPMUX=0\r\n";
-#define START_SINGLE_CONNECTION_COMMAND_RESPONSE  "AT+CIPMUX=0\r\r\n\r\nOK\r\n"
+static void finish_command(esp8266_at_result_t result)
+{
+    at_command_t *command = &s_at_commands[s_at_command_tail % AT_COMMAND_QUEUE_SIZE];
+    esp8266_at_callback_t callback = command->callback;
+    void *context = command->context;
 
-/** 
- * @brief Command to enable reception info
+    s_at_command_tail++;
+    s_wait_terminals = 0;
+    s_matched_terminal = 0;
+    s_link_state = LINK_STATE_IDLE;
+    if (callback != NULL)
+    {
+        callback(result, context);
+    }
+}
+
+/**
+ * @brief Completes the AT command being executed on its terminal token or timeout
  */
-static const char ENABLE_RECEPTION_COMMNAD []  = "AT+CIPDINFO=0\r\n" ;
-#define ENABLE_RECEPTION_COMMAND_RESPONSE   "AT+CIPDINFO=0\r\r\n\r\nOK\r\n"
+static void process_command(void)
+{
+    const at_command_t *command = &s_at_commands[s_at_command_tail % AT_COMMAND_QUEUE_SIZE];
+    if (s_matched_terminal != 0)
+    {
+        finish_command(terminal_to_result(s_matched_terminal));
+    }
+    else if (HAL_GetTick() - s_link_state_tick >= command->timeout)
+    {
+        finish_command(ESP8266_AT_TIMEOUT);
+    }
+}
 
 /**
- * @brief Waits for a specific response from ESP8266 within given time
+ * @brief Finishes the frame being sent and reports the result
  * 
- * @param expected_string Expected response string
- * @param delay_in_millisecond Delay before checking response
- * @return true if expected response received, false otherwise
+ * @param success true if ESP8266 reported SEND OK
  */
-static bool wait_for_reception(const char *expected_string, int delay_in_millisecond)
+static void finish_frame(bool success)
 {
-    HAL_Delay(delay_in_millisecond);
-    int result = strcmp(expected_string, (const char*)g_reception_buffer);
-    clear_reception_buffer();
-    return result == 0;
+    if (success != true)
+    {
+        // Release the part of the payload that was never handed to DMA
+        ring_buffer_discard(&s_transmit_ring, s_payload_remaining);
+        s_payload_remaining = 0;
+    }
+    s_transmit_frame_tail++;
+    s_wait_terminals = 0;
+    s_matched_terminal = 0;
+    s_link_state = LINK_STATE_IDLE;
+    if (s_send_callback != NULL)
+    {
+        s_send_callback(success);
+    }
 }
 
 /**
- * @brief Sends initial AT command to ESP8266 for connectivity check
+ * @brief Completion callback of AT+CIPRECVDATA
  * 
- * @return true if command successful, false otherwise
+ * A read that was filled completely may have left more data in ESP8266.
+ * 
+ * @param result Result of the command
+ * @param context Unused
  */
-static bool send_initial_command(void)
+static void on_received_data(esp8266_at_result_t result, void *context)
 {
-    HAL_UART_Transmit(&huart1, (const uint8_t*) INTIAL_COMMAND, sizeof(INTIAL_COMMAND), 100);
-    if (wait_for_reception(INITIAL_COMMAND_RESPONSE, 1000) != true)
+    s_receive_requested = false;
+    if (result == ESP8266_AT_OK && s_receive_length >= s_receive_requested_length)
     {
-        return false;
+        s_sockets[s_receive_link].receive_pending = true;
     }
-    return true;
 }
 
 /**
- * @brief Sends command to set ESP8266 to station mode
+ * @brief Reads data held by ESP8266 in passive receive mode
  * 
- * @return true if command successful, false otherwise
+ * Each read asks for no more than the reception ring of the link can take,
+ * so nothing is dropped: while the ring is full, data stays in ESP8266 and
+ * the TCP window closes towards the server. Links are served in turn so a
+ * busy link does not starve the others.
  */
-static bool send_set_station_command(void)
+static void request_received_data(void)
 {
-    HAL_UART_Transmit(&huart1, (const uint8_t*) SET_STATION_MODE_COMMAND, sizeof(SET_STATION_MODE_COMMAND), 100);
-    if (wait_for_reception(SET_STATION_MODE_COMMAND_RESPONSE, 1000) != true)
+    if (!s_passive_receive || s_receive_requested || s_tokenizer_state == TOKENIZER_PASSTHROUGH)
     {
-        return false;
+        return;
+    }
+
+    uint8_t link_id = s_receive_link;
+    uint32_t length = 0;
+    for (uint8_t i = 0; i < ESP8266_LINK_COUNT && length == 0; i++)
+    {
+        link_id = (link_id + 1) % ESP8266_LINK_COUNT;
+        const socket_t *socket = &s_sockets[link_id];
+        if (socket->receive_pending)
+        {
+            length = (socket->reception_ring != NULL) ? ring_buffer_space(socket->reception_ring) : PASSIVE_RECEIVE_CHUNK;
+        }
+    }
+    if (length > PASSIVE_RECEIVE_CHUNK)
+    {
+        length = PASSIVE_RECEIVE_CHUNK;
+    }
+    if (length == 0)
+    {
+        return;
+    }
+
+    char command[32];
+    if (s_multiple_connections)
+    {
+        snprintf(command, sizeof(command), "AT+CIPRECVDATA=%u,%lu\r\n", link_id, (unsigned long) length);
+    }
+    else
+    {
+        snprintf(command, sizeof(command), "AT+CIPRECVDATA=%lu\r\n", (unsigned long) length);
+    }
+    if (esp8266_at_submit(command, ESP8266_AT_TERMINAL_OK | ESP8266_AT_TERMINAL_ERROR, PASSIVE_RECEIVE_TIMEOUT,
+                          on_received_data, NULL))
+    {
+        s_sockets[link_id].receive_pending = false; // Set again by a new +IPD or a completely filled read
+        s_receive_link = link_id;
+        s_receive_requested = true;
+        s_receive_requested_length = length;
+        s_receive_length = 0;
     }
-    return true;
 }
 
 /**
- * @brief Disconnects ESP8266 from currently connected Wi-Fi
+ * @brief Queues buffer of data to be sent to connected TCP server
+ * 
+ * @param buffer Pointer to data buffer
+ * @param buffer_size Size of data buffer
+ * @return true if queued, false if buffer is too large or transmit queue is full
  */
-static void disconnect_from_wifi(void)
+bool send_buffer(const uint8_t *buffer, uint16_t buffer_size)
 {
-    HAL_UART_Transmit(&huart1, (const uint8_t*) DISCONNECT_FROM_WIFI_COMMAND, sizeof(DISCONNECT_FROM_WIFI_COMMAND), 100);
-    HAL_Delay(1000);
-    clear_reception_buffer();
+    esp8266_segment_t segment = { buffer, buffer_size };
+    return send_segments(&segment, 1);
 }
 
 /**
- * @brief Connects ESP8266 to specified Wi-Fi network
+ * @brief Queues several memory areas to be sent as one buffer with one AT+CIPSEND
  * 
- * @param essid Wi-Fi ESSID
- * @param password Wi-Fi password
- * @return true if connection successful, false otherwise
+ * @param segments Pointer to the segments, in sending order
+ * @param segment_count Number of segments
+ * @return true if queued, false if total is too large or transmit queue is full
+ */
+bool send_segments(const esp8266_segment_t *segments, uint8_t segment_count)
+{
+    return esp8266_socket_send_segments(ESP8266_PRIMARY_LINK, segments, segment_count);
+}
+
+/**
+ * @brief Queues a buffer to be sent on a link
+ * 
+ * @param link_id Link ID
+ * @param buffer Pointer to data buffer
+ * @param buffer_size Size of data buffer
+ * @return true if queued, false if buffer is too large or transmit queue is full
  */
-static bool connect_to_wifi(const char *essid, const char *password)
+bool esp8266_socket_send(uint8_t link_id, const uint8_t *buffer, uint16_t buffer_size)
 {
-    memset(s_dynamic_command, 0 ,sizeof(s_dynamic_command));
-    sprintf(s_dynamic_command, "AT+CWJAP=\"%s\",\"%s\"\r\n", essid, password);
-    uint16_t dynamic_command_length = strlen(s_dynamic_command);
-    HAL_UART_Transmit(&huart1, (const uint8_t*) s_dynamic_command, dynamic_command_length, 100);
+    esp8266_segment_t segment = { buffer, buffer_size };
+    return esp8266_socket_send_segments(link_id, &segment, 1);
+}
 
-    memset(s_dynamic_command_response, 0 ,sizeof(s_dynamic_command_response));
-    sprintf(s_dynamic_command_response, "AT+CWJAP=\"%s\",\"%s\"\r\r\nWIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n", essid, password);
-    if (wait_for_reception(s_dynamic_command_response, 20000) != true)
+/**
+ * @brief Queues several memory areas to be sent as one buffer on a link
+ * 
+ * Frames of all links share the transmit ring, so each link keeps its
+ * order and a large frame on one link only delays the others by one
+ * AT+CIPSEND.
+ * 
+ * @param link_id Link ID
+ * @param segments Pointer to the segments, in sending order
+ * @param segment_count Number of segments
+ * @return true if queued, false if total is too large or transmit queue is full
+ */
+bool esp8266_socket_send_segments(uint8_t link_id, const esp8266_segment_t *segments, uint8_t segment_count)
+{
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < segment_count; i++)
+    {
+        total += segments[i].length;
+    }
+    if (link_id >= ESP8266_LINK_COUNT || total == 0 || total > ESP8266_MAX_SEND_SIZE ||
+        (uint8_t)(s_transmit_frame_head - s_transmit_frame_tail) >= TRANSMIT_FRAME_QUEUE_SIZE ||
+        ring_buffer_space(&s_transmit_ring) < total)
     {
         return false;
     }
+    for (uint8_t i = 0; i < segment_count; i++)
+    {
+        ring_buffer_write(&s_transmit_ring, segments[i].data, segments[i].length);
+    }
+    transmit_frame_t *frame = &s_transmit_frames[s_transmit_frame_head % TRANSMIT_FRAME_QUEUE_SIZE];
+    frame->length = total;
+    frame->link_id = link_id;
+    frame->queued_tick = HAL_GetTick();
+    s_transmit_frame_head++;
     return true;
 }
 
 /**
- * @brief Sends command to start single connection mode
+ * @brief Queues an AT command for asynchronous execution
+ * 
+ * @param command Command text including "\r\n", copied into the queue
+ * @param terminals Combination of ESP8266_AT_TERMINAL_x tokens that complete the command
+ * @param timeout_in_millisecond Maximum time to wait for a terminal token
+ * @param callback Function called from esp8266_process() on completion, may be NULL
+ * @param context Passed to callback
+ * @return true if queued, false if command is too long or queue is full
+ */
+bool esp8266_at_submit(const char *command, uint8_t terminals, uint32_t timeout_in_millisecond,
+                       esp8266_at_callback_t callback, void *context)
+{
+    return esp8266_at_submit_query(command, terminals, timeout_in_millisecond, NULL, callback, context);
+}
+
+/**
+ * @brief Queues an AT command whose intermediate response lines are of interest
  * 
- * @return true if command successful, false otherwise
+ * @param command Command text including "\r\n", copied into the queue
+ * @param terminals Combination of ESP8266_AT_TERMINAL_x tokens that complete the command
+ * @param timeout_in_millisecond Maximum time to wait for a terminal token
+ * @param line_callback Function called for every other response line, may be NULL
+ * @param callback Function called from esp8266_process() on completion, may be NULL
+ * @param context Passed to both callbacks
+ * @return true if queued, false if command is too long or queue is full
  */
-static bool send_start_single_connection_command(void)
+bool esp8266_at_submit_query(const char *command, uint8_t terminals, uint32_t timeout_in_millisecond,
+                             esp8266_at_line_callback_t line_callback, esp8266_at_callback_t callback, void *context)
 {
-    HAL_UART_Transmit(&huart1, (const uint8_t*) START_SINGLE_CONNECTION_COMMAND, sizeof(START_SINGLE_CONNECTION_COMMAND), 100);
-    if (wait_for_reception(START_SINGLE_CONNECTION_COMMAND_RESPONSE, 1000) != true)
+    size_t length = strlen(command);
+    if (length == 0 || length >= AT_COMMAND_LENGTH ||
+        (uint8_t)(s_at_command_head - s_at_command_tail) >= AT_COMMAND_QUEUE_SIZE)
     {
         return false;
     }
+    at_command_t *entry = &s_at_commands[s_at_command_head % AT_COMMAND_QUEUE_SIZE];
+    memcpy(entry->text, command, length + 1);
+    entry->length = length;
+    entry->terminals = terminals;
+    entry->timeout = timeout_in_millisecond;
+    entry->line_callback = line_callback;
+    entry->callback = callback;
+    entry->context = context;
+    s_at_command_head++;
     return true;
 }
 
 /**
- * @brief Connects ESP8266 to TCP server at specified IP and port
+ * @brief Finishes every frame of the current transfer and reports their results
  * 
- * @param ip_address IP address of TCP server
- * @param port_number Port number of TCP server
- * @return true if connection successful, false otherwise
+ * @param success true if ESP8266 reported SEND OK
  */
-static bool connect_to_tcp(const char *ip_address, int port_number)
+static void finish_frames(bool success)
 {
-    memset(s_dynamic_command, 0 ,sizeof(s_dynamic_command));
-    sprintf(s_dynamic_command, "AT+CIPSTART=\"TCP\",\"%s\",%d\r\n", ip_address, port_number);
-    uint16_t dynamicCommandLength = strlen(s_dynamic_command);
-    HAL_UART_Transmit(&huart1, (const uint8_t*) s_dynamic_command, dynamicCommandLength, 100);
-
-    memset(s_dynamic_command_response, 0 ,sizeof(s_dynamic_command_response));
-    sprintf(s_dynamic_command_response, "AT+CIPSTART=\"TCP\",\"%s\",%d\r\r\nCONNECT\r\n\r\nOK\r\n", ip_address, port_number);
-    if (wait_for_reception(s_dynamic_command_response, 5000) != true)
+    for (; s_sending_frames > 0; s_sending_frames--)
     {
-        return false;
+        finish_frame(success);
     }
-    return true;
 }
 
 /**
- * @brief Enables reception info from ESP8266
+ * @brief Collects the queued frames that are sent with the next AT+CIPSEND
+ * 
+ * Takes consecutive frames of the link of the oldest frame as long as
+ * they fit into ESP8266_MAX_SEND_SIZE. They lie back to back in transmit
+ * ring, so they are sent as one payload without copying.
  * 
- * @return true if command successful, false otherwise
+ * @return true if the transaction cannot take more frames, false if later frames could still join it
  */
-static bool enable_reception_from_esp()
+static bool collect_frames(void)
 {
-    HAL_UART_Transmit(&huart1, (const uint8_t*) ENABLE_RECEPTION_COMMNAD, sizeof(ENABLE_RECEPTION_COMMNAD), 100);
-    if (wait_for_reception(ENABLE_RECEPTION_COMMAND_RESPONSE, 2000) != true)
+    const transmit_frame_t *first = &s_transmit_frames[s_transmit_frame_tail % TRANSMIT_FRAME_QUEUE_SIZE];
+    s_sending_frames = 0;
+    s_sending_length = 0;
+    for (uint8_t i = s_transmit_frame_tail; i != s_transmit_frame_head; i++)
     {
-        return false ;
+        const transmit_frame_t *frame = &s_transmit_frames[i % TRANSMIT_FRAME_QUEUE_SIZE];
+        if (frame->link_id != first->link_id || s_sending_length + frame->length > ESP8266_MAX_SEND_SIZE)
+        {
+            return true;
+        }
+        s_sending_length += frame->length;
+        s_sending_frames++;
     }
-    return true ;
+    return s_sending_length == ESP8266_MAX_SEND_SIZE || s_sending_frames >= TRANSMIT_FRAME_QUEUE_SIZE;
 }
 
 /**
- * @brief Connects STM32 to Wi-Fi network
+ * @brief Advances AT command execution and the AT+CIPSEND sequence, call from main loop
+ */
+void esp8266_process(void)
+{
+    transmit_frame_t *frame = &s_transmit_frames[s_transmit_frame_tail % TRANSMIT_FRAME_QUEUE_SIZE];
+
+    process_reception();
+    request_received_data();
+
+    switch (s_link_state)
+    {
+    case LINK_STATE_IDLE:
+        if (s_dma_transmit_busy)
+        {
+            break;
+        }
+        if (s_at_command_head != s_at_command_tail)
+        {
+            at_command_t *command = &s_at_commands[s_at_command_tail % AT_COMMAND_QUEUE_SIZE];
+            send_request(command->text, command->length, LINK_STATE_COMMAND, command->terminals);
+        }
+        else if (s_transmit_frame_head != s_transmit_frame_tail)
+        {
+            bool complete = collect_frames();
+            if (!complete && !s_flushing && HAL_GetTick() - frame->queued_tick < s_transmit_linger)
+            {
+                break; // Give packets queued right after this one a chance to share the AT+CIPSEND
+            }
+            if (s_multiple_connections)
+            {
+                sprintf(s_send_command, "AT+CIPSEND=%d,%lu\r\n", frame->link_id, (unsigned long) s_sending_length);
+            }
+            else
+            {
+                sprintf(s_send_command, "AT+CIPSEND=%lu\r\n", (unsigned long) s_sending_length);
+            }
+            send_request(s_send_command, strlen(s_send_command), LINK_STATE_SEND_PROMPT,
+                         ESP8266_AT_TERMINAL_PROMPT | ESP8266_AT_TERMINAL_ERROR);
+        }
+        break;
+
+    case LINK_STATE_COMMAND:
+        process_command();
+        break;
+
+    case LINK_STATE_SEND_PROMPT:
+        if (s_dma_transmit_busy)
+        {
+            break;
+        }
+        if (s_matched_terminal == ESP8266_AT_TERMINAL_PROMPT)
+        {
+            s_payload_remaining = s_sending_length;
+            if (transmit_next_payload_part())
+            {
+                wait_for_terminals(TERMINAL_SEND_OK | TERMINAL_SEND_FAIL | ESP8266_AT_TERMINAL_ERROR);
+                s_link_state_tick = HAL_GetTick();
+                s_link_state = LINK_STATE_SEND_PAYLOAD;
+            }
+        }
+        else if (s_matched_terminal != 0 || HAL_GetTick() - s_link_state_tick >= CIPSEND_PROMPT_TIMEOUT)
+        {
+            s_payload_remaining = s_sending_length;
+            finish_frames(false);
+        }
+        break;
+
+    case LINK_STATE_SEND_PAYLOAD:
+        if (!s_dma_transmit_busy)
+        {
+            s_link_state = LINK_STATE_SEND_RESULT;
+        }
+        break;
+
+    case LINK_STATE_SEND_RESULT:
+        if (s_matched_terminal != 0)
+        {
+            finish_frames(s_matched_terminal == TERMINAL_SEND_OK);
+        }
+        else if (HAL_GetTick() - s_link_state_tick >= CIPSEND_RESULT_TIMEOUT)
+        {
+            finish_frames(false);
+        }
+        break;
+
+    case LINK_STATE_PASSTHROUGH:
+        if (s_dma_transmit_busy || s_transmit_frame_head == s_transmit_frame_tail)
+        {
+            break;
+        }
+        // No AT+CIPSEND, every queued frame leaves in one transfer
+        s_payload_remaining = 0;
+        s_sending_frames = 0;
+        for (uint8_t i = s_transmit_frame_tail; i != s_transmit_frame_head; i++)
+        {
+            s_payload_remaining += s_transmit_frames[i % TRANSMIT_FRAME_QUEUE_SIZE].length;
+            s_sending_frames++;
+        }
+        if (transmit_next_payload_part())
+        {
+            s_link_state = LINK_STATE_PASSTHROUGH_PAYLOAD;
+        }
+        break;
+
+    case LINK_STATE_PASSTHROUGH_PAYLOAD:
+        if (s_dma_transmit_busy)
+        {
+            break;
+        }
+        finish_frames(true);
+        s_link_state = LINK_STATE_PASSTHROUGH;
+        break;
+    }
+}
+
+/**
+ * @brief Sets the function notified about the result of each sent buffer
  * 
- * @param essid Wi-Fi ESSID
- * @param password Wi-Fi password
- * @return true if connection successful, false otherwise
+ * @param callback Function to call, NULL to disable notifications
  */
-bool connect_to_network(const char* essid, const char *password)
+void esp8266_set_send_callback(esp8266_send_callback_t callback)
+{
+    s_send_callback = callback;
+}
+
+/**
+ * @brief Returns the number of queued buffers whose result is not reported yet
+ * 
+ * Results are reported in queueing order, so a buffer queued now is the
+ * one reported after this many send callbacks.
+ * 
+ * @return Number of queued buffers
+ */
+uint8_t esp8266_queued_buffer_count(void)
+{
+    return (uint8_t)(s_transmit_frame_head - s_transmit_frame_tail);
+}
+
+/**
+ * @brief Sets the function notified about unsolicited status lines
+ * 
+ * @param callback Function to call, NULL to disable notifications
+ */
+void esp8266_set_event_callback(esp8266_event_callback_t callback)
+{
+    s_event_callback = callback;
+}
+
+/**
+ * @brief Sets how long a queued frame waits for others to share its AT+CIPSEND
+ * 
+ * @param linger_in_millisecond Waiting time, 0 to send as soon as the link is idle
+ */
+void esp8266_set_transmit_linger(uint32_t linger_in_millisecond)
 {
-    HAL_UART_Receive_IT(&huart1, (uint8_t*)&s_reception_byte, 1);
-    HAL_Delay(1000);
+    s_transmit_linger = linger_in_millisecond;
+}
 
-    if (send_initial_command() != true)
+/**
+ * @brief Runs the transmit sequence until all queued frames are sent
+ * 
+ * Queued frames are sent without lingering.
+ * 
+ * @param timeout_in_millisecond Maximum time to wait
+ * @return true if transmit queue is empty, false on timeout
+ */
+bool esp8266_flush_transmit(uint32_t timeout_in_millisecond)
+{
+    uint32_t start_tick = HAL_GetTick();
+    bool result = true;
+    s_flushing = true;
+    while (s_transmit_frame_head != s_transmit_frame_tail ||
+           (s_link_state != LINK_STATE_IDLE && s_link_state != LINK_STATE_PASSTHROUGH))
     {
-        return false;
+        if (HAL_GetTick() - start_tick >= timeout_in_millisecond)
+        {
+            result = false;
+            break;
+        }
+        esp8266_process();
     }
-    HAL_Delay(100);
+    s_flushing = false;
+    return result;
+}
 
-    if (send_set_station_command() != true)
+/**
+ * @brief Selects between passive and active reception of TCP data
+ * 
+ * In passive mode ESP8266 only announces received data with "+IPD,<length>"
+ * and keeps it until esp8266_process() reads it with AT+CIPRECVDATA in
+ * chunks that fit into TCP reception ring. Refused during transparent
+ * transmission, where AT commands cannot be sent.
+ * 
+ * @param passive true for passive mode, false for active mode
+ * @return true if ESP8266 accepted the mode, false otherwise or during transparent transmission
+ */
+bool esp8266_set_passive_receive(bool passive)
+{
+    if (s_tokenizer_state == TOKENIZER_PASSTHROUGH)
+    {
+        return false; // AT commands are not sent until esp8266_stop_passthrough()
+    }
+    if (run_command(passive ? PASSIVE_RECEIVE_COMMAND : ACTIVE_RECEIVE_COMMAND, 1000) != ESP8266_AT_OK)
     {
         return false;
     }
-    HAL_Delay(100);
+    s_passive_receive = passive;
+    for (uint8_t i = 0; i < ESP8266_LINK_COUNT; i++)
+    {
+        s_sockets[i].receive_pending = passive && s_sockets[i].open; // Data may have arrived before the switch
+    }
+    return true;
+}
 
-    disconnect_from_wifi();
-    HAL_Delay(500);
+/**
+ * @brief Selects single or multiple connection mode
+ * 
+ * AT+CIPMUX is sent with the next connection attempt, as ESP8266 refuses
+ * to change it while a connection is open.
+ * 
+ * @param enabled true for multiple connections, links 0 to 4
+ */
+void esp8266_set_multiple_connections(bool enabled)
+{
+    if (enabled != s_multiple_connections)
+    {
+        s_multiple_connections = enabled;
+        s_connection_mode_applied = false;
+    }
+}
 
-    if (connect_to_wifi(essid, password) != true)
+/**
+ * @brief Opens a TCP connection or UDP socket on a link
+ * 
+ * @param link_id Link ID, other than ESP8266_PRIMARY_LINK
+ * @param type Transport
+ * @param address IP address of remote host
+ * @param port Port number of remote host
+ * @param reception_ring Ring receiving the data of the link, NULL to discard it
+ * @return true if opened, false otherwise
+ */
+bool esp8266_socket_open(uint8_t link_id, esp8266_socket_type_t type, const char *address, int port,
+                         ring_buffer_t *reception_ring)
+{
+    if (!s_multiple_connections || link_id >= ESP8266_LINK_COUNT || link_id == ESP8266_PRIMARY_LINK)
     {
         return false;
     }
+    s_sockets[link_id].reception_ring = reception_ring;
+    return start_open_operation(link_id, (type == ESP8266_SOCKET_UDP) ? "UDP" : "TCP", address, port, false) &&
+           wait_for_operation();
+}
 
-    return true;
+/**
+ * @brief Closes the connection on a link
+ * 
+ * Transparent transmission is left first, it only exists on
+ * ESP8266_PRIMARY_LINK.
+ * 
+ * @param link_id Link ID
+ */
+void esp8266_socket_close(uint8_t link_id)
+{
+    if (link_id < ESP8266_LINK_COUNT)
+    {
+        esp8266_stop_passthrough();
+        close_connection(link_id);
+    }
 }
 
 /**
- * @brief Connects STM32 to TCP server
+ * @brief Tells whether a link is open
  * 
- * @param ip_address IP address of TCP server
- * @param port_number Port number of TCP server
- * @return true if connection successful, false otherwise
+ * @param link_id Link ID
+ * @return true from "CONNECT" until "CLOSED" or esp8266_socket_close()
  */
-bool connect_to_tcp_server(const char *ip_address, int port_number)
+bool esp8266_socket_is_open(uint8_t link_id)
+{
+    return link_id < ESP8266_LINK_COUNT && s_sockets[link_id].open;
+}
+
+/**
+ * @brief Switches the open TCP connection to transparent transmission
+ * 
+ * After AT+CIPMODE=1 and a single AT+CIPSEND every queued buffer is handed
+ * to DMA as it is, without AT+CIPSEND, prompt and SEND OK, and every
+ * received byte is TCP data. ESP8266 reports neither SEND OK nor status
+ * lines in this mode, so a dead connection is only noticed by the protocol
+ * above. Requires single connection mode.
+ * 
+ * @return true if transparent transmission started, false if ESP8266 refused it or multiple connections are used
+ */
+bool esp8266_start_passthrough(void)
 {
-    if (send_start_single_connection_command() != true)
+    if (s_tokenizer_state == TOKENIZER_PASSTHROUGH)
+    {
+        return true;
+    }
+    if (s_multiple_connections)
     {
         return false;
     }
-    if (connect_to_tcp(ip_address, port_number) != true)
+    esp8266_flush_transmit(PASSTHROUGH_FLUSH_TIMEOUT);
+    if (run_command(PASSTHROUGH_MODE_COMMAND, 1000) != ESP8266_AT_OK)
     {
         return false;
     }
-    if (enable_reception_from_esp() != true)
+
+    blocking_command_t blocking = { false, ESP8266_AT_TIMEOUT };
+    if (esp8266_at_submit(START_PASSTHROUGH_COMMAND, ESP8266_AT_TERMINAL_PROMPT | ESP8266_AT_TERMINAL_ERROR,
+                          CIPSEND_PROMPT_TIMEOUT, on_blocking_command_complete, &blocking) == true)
+    {
+        while (blocking.completed != true)
+        {
+            esp8266_process();
+        }
+    }
+    if (blocking.result != ESP8266_AT_PROMPT)
     {
+        run_command(NORMAL_MODE_COMMAND, 1000); // AT+CIPSEND=<length> does not work with CIPMODE=1
         return false;
     }
+
+    // Bytes following the prompt are TCP data already
+    s_response_line_length = 0;
+    s_tokenizer_state = TOKENIZER_PASSTHROUGH;
+    s_link_state = LINK_STATE_PASSTHROUGH;
     return true;
 }
 
 /**
- * @brief Sends buffer of data to connected TCP server
+ * @brief Ends transparent transmission and returns to AT commands
  * 
- * @param buffer Pointer to data buffer
- * @param buffer_size Size of data buffer
+ * Queued buffers are sent first. "+++" is only recognized with a pause on
+ * both sides, so this blocks for about PASSTHROUGH_EXIT_TIME.
+ */
+void esp8266_stop_passthrough(void)
+{
+    if (s_tokenizer_state != TOKENIZER_PASSTHROUGH)
+    {
+        return;
+    }
+    esp8266_flush_transmit(PASSTHROUGH_FLUSH_TIMEOUT);
+    send_exit_passthrough_sequence();
+
+    process_reception(); // TCP data received before "+++" took effect
+    s_tokenizer_state = TOKENIZER_LINE;
+    s_link_state = LINK_STATE_IDLE;
+    run_command(NORMAL_MODE_COMMAND, 1000);
+}
+
+/**
+ * @brief Tells whether transparent transmission is active
+ * 
+ * @return true between esp8266_start_passthrough() and esp8266_stop_passthrough()
  */
-void send_buffer(uint8_t *buffer, uint16_t buffer_size)
+bool esp8266_is_passthrough(void)
 {
-    memset(s_dynamic_command, 0, sizeof(s_dynamic_command));
-    sprintf(s_dynamic_command, "AT+CIPSEND=%d\r\n", buffer_size);
-    uint16_t dynamic_command_length = strlen(s_dynamic_command);
-    HAL_UART_Transmit(&huart1, (const uint8_t*) s_dynamic_command, dynamic_command_length, 100);
-    HAL_Delay(100);
+    return s_tokenizer_state == TOKENIZER_PASSTHROUGH;
+}
 
-    HAL_UART_Transmit(&huart1, (const uint8_t*) buffer, buffer_size, 100);
-    HAL_Delay(100);
+/**
+ * @brief Discards the TCP data currently stored in reception buffer
+ */
+void clear_reception_buffer(void)
+{
+    ring_buffer_flush(&g_reception_ring);
 }
 
 /**
- * @brief Sends buffer of data to connected TCP server and clears response buffer
+ * @brief UART reception event callback
  * 
- * @param buffer Pointer to data buffer
- * @param buffer_size Size of data buffer
+ * Called from DMA half/full transfer and UART idle-line interrupts. Copies
+ * the bytes written by DMA since the previous event into UART reception ring.
+ * 
+ * @param huart UART handle
+ * @param size Position of DMA write pointer in circular DMA buffer
  */
-void send_buffer_and_clear_response(uint8_t *buffer, uint16_t buffer_size)
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t size)
 {
-    uint16_t start_index = s_reception_buffer_index;
-    memset(s_dynamic_command, 0, sizeof(s_dynamic_command));
-    sprintf(s_dynamic_command, "AT+CIPSEND=%d\r\n", buffer_size);
-    uint16_t dynamic_command_length = strlen(s_dynamic_command);
-    HAL_UART_Transmit(&huart1, (const uint8_t*) s_dynamic_command, dynamic_command_length, 100);
-    HAL_Delay(100);
+    if (huart->Instance != USART1)
+    {
+        return;
+    }
+
+    if (size == s_dma_read_position)
+    {
+        return;
+    }
 
-    HAL_UART_Transmit(&huart1, (const uint8_t*) buffer, buffer_size, 100);
-    HAL_Delay(100);
-    if (s_reception_buffer_index > start_index)
+    if (size > s_dma_read_position)
     {
-        memset(&g_reception_buffer[start_index], 0, s_reception_buffer_index - start_index);
+        ring_buffer_write(&s_uart_reception_ring, &s_dma_reception_buffer[s_dma_read_position], size - s_dma_read_position);
     }
     else
     {
-        memset(&g_reception_buffer[start_index], 0, sizeof(g_reception_buffer) - start_index);
-        memset(g_reception_buffer, 0, s_reception_buffer_index);
+        ring_buffer_write(&s_uart_reception_ring, &s_dma_reception_buffer[s_dma_read_position],
+                          sizeof(s_dma_reception_buffer) - s_dma_read_position);
+        ring_buffer_write(&s_uart_reception_ring, s_dma_reception_buffer, size);
     }
-    s_reception_buffer_index = start_index;
+    s_dma_read_position = size % sizeof(s_dma_reception_buffer);
 }
 
 /**
- * @brief Clears reception buffer and index
+ * @brief UART transmit complete callback
+ * 
+ * Releases the transmitted bytes from transmit ring and continues with the
+ * wrapped part of the current frame, if any.
+ * 
+ * @param huart UART handle
  */
-void clear_reception_buffer(void)
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
-    memset(g_reception_buffer, 0, sizeof(g_reception_buffer));
-    s_reception_buffer_index = 0;
+    if (huart->Instance != USART1)
+    {
+        return;
+    }
+
+    ring_buffer_discard(&s_transmit_ring, s_dma_transmit_length);
+    s_payload_remaining -= s_dma_transmit_length;
+    s_dma_transmit_length = 0;
+    if (s_payload_remaining == 0 || !transmit_next_payload_part())
+    {
+        s_dma_transmit_busy = false;
+    }
 }
 
 /**
- * @brief UART receive interrupt callback
+ * @brief UART error callback
  * 
- * Handles UART reception and stores data in reception buffer.
+ * Overrun, noise or framing errors abort the DMA reception, restart it so
+ * the link keeps receiving.
  * 
  * @param huart UART handle
  */
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
 {
-    g_reception_buffer[s_reception_buffer_index] = (char) s_reception_byte;
-    s_reception_buffer_index = (s_reception_buffer_index+1) % sizeof(g_reception_buffer);
-    HAL_UART_Receive_IT(&huart1, (uint8_t*)&s_reception_byte, 1);
+    if (huart->Instance == USART1)
+    {
+        start_reception();
+    }
 }
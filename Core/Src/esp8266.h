@@ -8,19 +8,149 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include "ring_buffer.h"
 
-#define RECEPTION_BUFFER_SIZE 512 /**< Size of reception buffer */
+#define RECEPTION_BUFFER_SIZE 2048 /**< Size of TCP reception ring, must be a power of two */
+#define ESP8266_MAX_SEND_SIZE 2048 /**< Largest buffer AT+CIPSEND accepts at once */
+#define ESP8266_TRANSMIT_LINGER 5  /**< Default time in milliseconds a queued buffer waits for others to share its AT+CIPSEND */
+#define ESP8266_LINK_COUNT    5    /**< Link IDs 0 to 4 with multiple connections */
+#define ESP8266_PRIMARY_LINK  0    /**< Link used by connect_to_tcp_server() and send_segments() */
 
-extern uint8_t g_reception_buffer[RECEPTION_BUFFER_SIZE]; /**< Reception buffer */
+#define ESP8266_AT_TERMINAL_OK      0x01 /**< Command completes on "OK" */
+#define ESP8266_AT_TERMINAL_ERROR   0x02 /**< Command completes on "ERROR" */
+#define ESP8266_AT_TERMINAL_FAIL    0x04 /**< Command completes on "FAIL" */
+#define ESP8266_AT_TERMINAL_PROMPT  0x08 /**< Command completes on the '>' prompt */
+
+/**
+ * @brief Result of an AT command.
+ */
+typedef enum
+{
+    ESP8266_AT_OK,       /**< "OK" received */
+    ESP8266_AT_ERROR,    /**< "ERROR" received or command could not be queued */
+    ESP8266_AT_FAIL,     /**< "FAIL" received */
+    ESP8266_AT_PROMPT,   /**< '>' prompt received */
+    ESP8266_AT_TIMEOUT   /**< No terminal token within the timeout */
+} esp8266_at_result_t;
+
+/**
+ * @brief Status reported by ESP8266 in unsolicited response lines.
+ */
+typedef enum
+{
+    ESP8266_EVENT_NONE,               /**< No event */
+    ESP8266_EVENT_WIFI_CONNECTED,     /**< "WIFI CONNECTED" */
+    ESP8266_EVENT_WIFI_GOT_IP,        /**< "WIFI GOT IP" */
+    ESP8266_EVENT_WIFI_DISCONNECTED,  /**< "WIFI DISCONNECT" */
+    ESP8266_EVENT_TCP_CONNECTED,      /**< "CONNECT" or "ALREADY CONNECTED" */
+    ESP8266_EVENT_TCP_CLOSED          /**< "CLOSED" */
+} esp8266_event_t;
+
+/**
+ * @brief Progress of a connection operation.
+ */
+typedef enum
+{
+    ESP8266_OPERATION_IDLE,      /**< None started yet */
+    ESP8266_OPERATION_RUNNING,   /**< AT commands being executed by esp8266_process() */
+    ESP8266_OPERATION_SUCCEEDED, /**< Connected */
+    ESP8266_OPERATION_FAILED     /**< A step failed */
+} esp8266_operation_status_t;
+
+/**
+ * @brief Transport of a socket.
+ */
+typedef enum
+{
+    ESP8266_SOCKET_TCP,  /**< TCP connection */
+    ESP8266_SOCKET_UDP   /**< UDP with a fixed remote address */
+} esp8266_socket_type_t;
+
+/**
+ * @brief Function notified when an AT command completes.
+ * @param result Result of the command.
+ * @param context Context given when the command was submitted.
+ */
+typedef void (*esp8266_at_callback_t)(esp8266_at_result_t result, void *context);
+
+/**
+ * @brief Function notified about a response line of an AT command that is not a final result code.
+ * @param line Response line without "\r\n".
+ * @param context Context given when the command was submitted.
+ */
+typedef void (*esp8266_at_line_callback_t)(const char *line, void *context);
+
+/**
+ * @brief Function notified about unsolicited status lines.
+ * @param event Reported status.
+ */
+typedef void (*esp8266_event_callback_t)(esp8266_event_t event);
+
+/**
+ * @brief Function notified when ESP8266 reports the result of a sent buffer.
+ * @param success true on SEND OK, false on SEND FAIL, ERROR or timeout.
+ */
+typedef void (*esp8266_send_callback_t)(bool success);
+
+/**
+ * @brief A piece of a buffer that is sent from several separate memory areas.
+ */
+typedef struct
+{
+    const uint8_t *data;  /**< Pointer to the data */
+    uint16_t length;      /**< Number of bytes */
+} esp8266_segment_t;
+
+extern ring_buffer_t g_reception_ring; /**< TCP data received on the primary link with +IPD framing removed */
 
 /**
  * @brief Connects to a Wi-Fi network.
+ *
+ * An association with the same network that still has an IP address, as
+ * after a reset of the MCU alone, is reused instead of joining again.
+ *
  * @param essid Pointer to the ESSID (network name) string.
  * @param password Pointer to the password string for the Wi-Fi network.
  * @retval true if successfully connected, false otherwise.
  */
 bool connect_to_network(const char* essid, const char *password);
 
+/**
+ * @brief Leaves the Wi-Fi network, so that the next connect_to_network() joins again.
+ */
+void disconnect_from_network(void);
+
+/**
+ * @brief Starts connecting to a Wi-Fi network without waiting for the result.
+ *
+ * The AT commands of connect_to_network() are executed one after another
+ * by esp8266_process(), so the main loop keeps running during the join.
+ * Only leaving transparent transmission blocks, for about a second.
+ *
+ * @param essid Pointer to the ESSID (network name) string.
+ * @param password Pointer to the password string for the Wi-Fi network.
+ * @param rejoin true to leave and join again even if already associated.
+ * @retval true if started, false if another operation is running or the parameters are too long.
+ */
+bool esp8266_start_network_connect(const char *essid, const char *password, bool rejoin);
+
+/**
+ * @brief Starts reopening the TCP connection without waiting for the result.
+ *
+ * Closes the connection first, then opens it like connect_to_tcp_server().
+ *
+ * @param ip_address Pointer to the IP address string of the server.
+ * @param port_number Port number of the TCP server.
+ * @retval true if started, false if another operation is running.
+ */
+bool esp8266_start_tcp_connect(const char *ip_address, int port_number);
+
+/**
+ * @brief Reports the progress of the operation started last.
+ * @retval Status of the operation.
+ */
+esp8266_operation_status_t esp8266_operation_status(void);
+
 /**
  * @brief Connects to a TCP server.
  * @param ip_address Pointer to the IP address string of the server.
@@ -30,14 +160,207 @@ bool connect_to_network(const char* essid, const char *password);
 bool connect_to_tcp_server(const char *ip_address, int port_number);
 
 /**
- * @brief Sends a buffer over the established connection.
+ * @brief Closes the TCP connection, errors are ignored as the socket may already be closed.
+ */
+void disconnect_from_tcp_server(void);
+
+/**
+ * @brief Queues a buffer to be sent over the established connection.
+ *
+ * The data is copied into the transmit queue and sent by DMA from
+ * esp8266_process() as soon as ESP8266 shows the AT+CIPSEND prompt,
+ * the function returns immediately.
+ *
  * @param buffer Pointer to the buffer containing data to be sent.
  * @param buffer_size Size of the buffer to be sent.
+ * @retval true if queued, false if the buffer exceeds ESP8266_MAX_SEND_SIZE or the transmit queue is full.
+ */
+bool send_buffer(const uint8_t *buffer, uint16_t buffer_size);
+
+/**
+ * @brief Queues several memory areas to be sent as one buffer.
+ *
+ * The segments are copied one after another straight into the transmit
+ * queue that DMA sends from, so no contiguous copy is needed beforehand.
+ *
+ * @param segments Pointer to the segments, in sending order.
+ * @param segment_count Number of segments.
+ * @retval true if queued, false if the total exceeds ESP8266_MAX_SEND_SIZE or the transmit queue is full.
+ */
+bool send_segments(const esp8266_segment_t *segments, uint8_t segment_count);
+
+/**
+ * @brief Selects single (AT+CIPMUX=0, default) or multiple (AT+CIPMUX=1) connections.
+ *
+ * Takes effect with the next connect_to_tcp_server() or esp8266_socket_open(),
+ * call it while no connection is open. With multiple connections the
+ * single-connection functions use link ESP8266_PRIMARY_LINK and
+ * transparent transmission is not available.
+ *
+ * @param enabled true for multiple connections.
+ */
+void esp8266_set_multiple_connections(bool enabled);
+
+/**
+ * @brief Opens a TCP connection or UDP socket on a link, requires multiple connections.
+ * @param link_id Link ID below ESP8266_LINK_COUNT, other than ESP8266_PRIMARY_LINK.
+ * @param type Transport.
+ * @param address Pointer to the IP address string of the remote host.
+ * @param port Remote port.
+ * @param reception_ring Ring receiving the data of this link, NULL to discard received data.
+ * @retval true if opened, false otherwise.
+ */
+bool esp8266_socket_open(uint8_t link_id, esp8266_socket_type_t type, const char *address, int port,
+                         ring_buffer_t *reception_ring);
+
+/**
+ * @brief Closes the connection on a link.
+ * @param link_id Link ID.
+ */
+void esp8266_socket_close(uint8_t link_id);
+
+/**
+ * @brief Tells whether a link is open.
+ * @param link_id Link ID.
+ * @retval true if open, false if closed or never opened.
+ */
+bool esp8266_socket_is_open(uint8_t link_id);
+
+/**
+ * @brief Queues a buffer to be sent on a link.
+ * @param link_id Link ID.
+ * @param buffer Pointer to the data, copied.
+ * @param buffer_size Size of the data.
+ * @retval true if queued, false if the buffer is too large or the transmit queue is full.
+ */
+bool esp8266_socket_send(uint8_t link_id, const uint8_t *buffer, uint16_t buffer_size);
+
+/**
+ * @brief Queues several memory areas to be sent as one buffer on a link.
+ *
+ * Buffers of all links share the transmit queue and keep their order per
+ * link.
+ *
+ * @param link_id Link ID.
+ * @param segments Pointer to the segments, in sending order.
+ * @param segment_count Number of segments.
+ * @retval true if queued, false if the total exceeds ESP8266_MAX_SEND_SIZE or the transmit queue is full.
+ */
+bool esp8266_socket_send_segments(uint8_t link_id, const esp8266_segment_t *segments, uint8_t segment_count);
+
+/**
+ * @brief Queues an AT command for asynchronous execution.
+ *
+ * Commands are sent one at a time from esp8266_process(), each completes on
+ * the first response line matching one of its terminal tokens or when its
+ * timeout expires. Command echo and status lines are ignored.
+ *
+ * @param command Command text including "\r\n", copied into the queue.
+ * @param terminals Combination of ESP8266_AT_TERMINAL_x tokens that complete the command.
+ * @param timeout_in_millisecond Maximum time to wait for a terminal token.
+ * @param callback Function called from esp8266_process() on completion, may be NULL.
+ * @param context Passed to callback.
+ * @retval true if queued, false if the command is too long or the queue is full.
+ */
+bool esp8266_at_submit(const char *command, uint8_t terminals, uint32_t timeout_in_millisecond,
+                       esp8266_at_callback_t callback, void *context);
+
+/**
+ * @brief Queues an AT command whose intermediate response lines are of interest.
+ * @param command Command text including "\r\n", copied into the queue.
+ * @param terminals Combination of ESP8266_AT_TERMINAL_x tokens that complete the command.
+ * @param timeout_in_millisecond Maximum time to wait for a terminal token.
+ * @param line_callback Function called for every other response line, may be NULL.
+ * @param callback Function called from esp8266_process() on completion, may be NULL.
+ * @param context Passed to both callbacks.
+ * @retval true if queued, false if the command is too long or the queue is full.
+ */
+bool esp8266_at_submit_query(const char *command, uint8_t terminals, uint32_t timeout_in_millisecond,
+                             esp8266_at_line_callback_t line_callback, esp8266_at_callback_t callback, void *context);
+
+/**
+ * @brief Advances AT command execution, asynchronous transmission and +IPD decoding, must be called periodically from the main loop.
+ */
+void esp8266_process(void);
+
+/**
+ * @brief Sets the function notified about the result of each sent buffer.
+ * @param callback Function to call, NULL to disable notifications.
+ */
+void esp8266_set_send_callback(esp8266_send_callback_t callback);
+
+/**
+ * @brief Returns the number of queued buffers whose result is not reported yet.
+ *
+ * Results are reported in queueing order, so the buffer queued last is
+ * reported by the send callback after this many results.
+ *
+ * @retval Number of queued buffers, including the one being sent.
+ */
+uint8_t esp8266_queued_buffer_count(void);
+
+/**
+ * @brief Sets the function notified about unsolicited status lines.
+ * @param callback Function to call, NULL to disable notifications.
+ */
+void esp8266_set_event_callback(esp8266_event_callback_t callback);
+
+/**
+ * @brief Sets how long a queued buffer waits for others before AT+CIPSEND is issued.
+ *
+ * Buffers queued on the same link are sent with one AT+CIPSEND of up to
+ * ESP8266_MAX_SEND_SIZE bytes, so a PUBLISH, a PUBACK and a PINGREQ queued
+ * together pay for one prompt and one SEND OK. The wait ends early once
+ * the buffers fill a transaction. esp8266_flush_transmit() does not wait.
+ *
+ * @param linger_in_millisecond Waiting time, 0 to send as soon as the link is idle.
+ */
+void esp8266_set_transmit_linger(uint32_t linger_in_millisecond);
+
+/**
+ * @brief Runs esp8266_process() until every queued buffer is sent.
+ * @param timeout_in_millisecond Maximum time to wait.
+ * @retval true if the transmit queue is empty, false on timeout.
+ */
+bool esp8266_flush_transmit(uint32_t timeout_in_millisecond);
+
+/**
+ * @brief Selects between passive (AT+CIPRECVMODE=1) and active reception of TCP data.
+ *
+ * In passive mode ESP8266 keeps received data until esp8266_process() reads
+ * it with AT+CIPRECVDATA, never more than g_reception_ring can take, so a
+ * burst from the server is held back instead of overwriting unread data.
+ *
+ * @param passive true for passive mode, false for active mode (default).
+ * @retval true if ESP8266 accepted the mode, false otherwise or during transparent transmission.
+ */
+bool esp8266_set_passive_receive(bool passive);
+
+/**
+ * @brief Switches the open TCP connection to transparent transmission (AT+CIPMODE=1).
+ *
+ * Queued buffers are then written to the UART as they are, without
+ * AT+CIPSEND, prompt and SEND OK, and all received bytes are TCP data.
+ * Status lines are not reported in this mode. Functions issuing AT
+ * commands leave transparent transmission first.
+ *
+ * @retval true if transparent transmission started, false otherwise.
+ */
+bool esp8266_start_passthrough(void);
+
+/**
+ * @brief Sends the queued buffers and leaves transparent transmission with "+++".
+ */
+void esp8266_stop_passthrough(void);
+
+/**
+ * @brief Tells whether transparent transmission is active.
+ * @retval true if active, false otherwise.
  */
-void send_buffer(uint8_t *buffer, uint16_t buffer_size);
+bool esp8266_is_passthrough(void);
 
 /**
- * @brief Clears the reception buffer.
+ * @brief Discards the TCP data currently stored in the reception buffer.
  */
 void clear_reception_buffer(void);
 
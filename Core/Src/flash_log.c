@@ -0,0 +1,610 @@
+/**
+ * @file    flash_log.c
+ * @brief   Store-and-forward log of outgoing MQTT messages in internal flash.
+ *
+ * The LOG region is a ring of pages. Each page starts with a header carrying
+ * a sequence number, followed by 8-byte aligned records. The page being
+ * written is mirrored in RAM: records are collected there and programmed in
+ * one batch, and a page is erased only right before it is reused, so every
+ * page wears at the same rate.
+ *
+ * A record is marked as sent by programming its "drained" double word to
+ * zero, which the STM32L4 flash allows on an already programmed double word.
+ * That happens only once the record is confirmed: by PUBACK for QoS 1, by
+ * the ESP8266 send result for QoS 0. During transparent transmission QoS 0
+ * records are published with QoS 1 as well, as ESP8266 reports no result
+ * there. After a failed send the records are queued again from the oldest
+ * unconfirmed one. After a reset the oldest record that is not marked is
+ * the next to send.
+ *
+ * Records are programmed with double-word programming, which never masks
+ * interrupts, instead of fast row programming, which masks them for a whole
+ * row.
+ */
+
+#include "flash_log.h"
+#include "esp8266.h"
+#include "stm_mqtt.h"
+#include "stm32l4xx_hal.h"
+#include <stddef.h>
+#include <string.h>
+
+#define PAGE_MAGIC        0x474F4C46 /**< "FLOG", marks a page in use */
+#define RECORD_MAGIC      0x4352     /**< "RC", marks a record */
+#define DRAINED_PENDING   0xFFFFFFFFFFFFFFFFULL /**< Erased "drained" double word, record not sent */
+#define UNCONFIRMED_SIZE  8          /**< Records queued for sending whose result is not known yet */
+
+extern uint8_t _log_flash_start[]; /**< Start of LOG region, from the linker script */
+extern uint8_t _log_flash_end[];   /**< End of LOG region, from the linker script */
+
+/**
+ * @brief Header at the start of every log page
+ */
+typedef struct
+{
+    uint32_t magic;      /**< PAGE_MAGIC */
+    uint32_t sequence;   /**< Incremented for every page started */
+} page_header_t;
+
+/**
+ * @brief Header in front of every record, followed by topic and payload
+ */
+typedef struct
+{
+    uint16_t magic;           /**< RECORD_MAGIC */
+    uint16_t topic_length;    /**< Length of the topic */
+    uint16_t payload_length;  /**< Length of the payload */
+    uint8_t qos;              /**< QoS to publish with */
+    uint8_t checksum;         /**< Sum of lengths, topic and payload */
+    uint64_t drained;         /**< DRAINED_PENDING until published, then 0 */
+} record_header_t;
+
+/**
+ * @brief A record queued for sending, waiting for its confirmation
+ */
+typedef struct
+{
+    bool used;                  /**< Slot holds a record */
+    uint8_t qos;                /**< QoS the record was published with */
+    uint16_t packet_identifier; /**< QoS 1: identifier PUBACK carries */
+    uint32_t result_count;      /**< QoS 0: value of s_send_results when its send result arrives */
+    uint32_t page;              /**< Page of the record */
+    uint32_t offset;            /**< Offset of the record */
+} unconfirmed_record_t;
+
+static uint64_t s_page_buffer[FLASH_PAGE_SIZE / sizeof(uint64_t)]; /**< RAM copy of the page being written */
+static uint8_t *const s_page = (uint8_t*) s_page_buffer;
+static uint32_t s_write_page = 0;      /**< Page being written */
+static uint32_t s_write_sequence = 0;  /**< Sequence number of the page being written */
+static uint32_t s_write_offset = 0;    /**< End of the records in s_page */
+static uint32_t s_flushed_offset = 0;  /**< End of the part of s_page already programmed */
+static uint32_t s_unflushed_tick = 0;  /**< Time the oldest unprogrammed record was appended */
+static uint32_t s_read_page = 0;       /**< Page of the oldest record that may not be confirmed */
+static uint32_t s_read_offset = 0;     /**< Offset of the oldest record that may not be confirmed */
+static uint32_t s_send_page = 0;       /**< Page of the next record to check for sending */
+static uint32_t s_send_offset = 0;     /**< Offset of the next record to check for sending */
+static uint32_t s_pending = 0;         /**< Records not confirmed yet */
+static unconfirmed_record_t s_unconfirmed[UNCONFIRMED_SIZE]; /**< Queued records waiting for confirmation */
+static uint32_t s_send_results = 0;    /**< ESP8266 send results reported so far */
+static bool s_resend = false;          /**< A send failed, queue again from the read position once nothing is unconfirmed */
+static uint32_t s_drain_tick = 0;      /**< Start of the current drain period */
+static uint8_t s_drain_budget = 0;     /**< Records that may still be sent in this period */
+
+/**
+ * @brief Returns the number of pages in the LOG region.
+ * @retval Number of pages.
+ */
+static uint32_t page_count(void)
+{
+    return (uint32_t)(_log_flash_end - _log_flash_start) / FLASH_PAGE_SIZE;
+}
+
+/**
+ * @brief Returns the flash address of a page.
+ * @param page Page index within the region.
+ * @retval Pointer to the page in flash.
+ */
+static uint8_t *page_address(uint32_t page)
+{
+    return &_log_flash_start[page * FLASH_PAGE_SIZE];
+}
+
+/**
+ * @brief Returns the memory to read a page from, the RAM copy for the page being written.
+ * @param page Page index within the region.
+ * @retval Pointer to the page contents.
+ */
+static uint8_t *page_data(uint32_t page)
+{
+    return (page == s_write_page) ? s_page : page_address(page);
+}
+
+/**
+ * @brief Computes the checksum of a record.
+ * @param header Pointer to the record header, followed by topic and payload.
+ * @retval Checksum.
+ */
+static uint8_t record_checksum(const record_header_t *header)
+{
+    const uint8_t *data = (const uint8_t*)(header + 1);
+    uint8_t sum = (uint8_t)(header->topic_length + header->payload_length + header->qos);
+    for (uint32_t i = 0; i < (uint32_t) header->topic_length + header->payload_length; i++)
+    {
+        sum += data[i];
+    }
+    return sum;
+}
+
+/**
+ * @brief Returns the space a record takes in a page.
+ * @param topic_length Length of the topic.
+ * @param payload_length Length of the payload.
+ * @retval Size in bytes, a multiple of 8.
+ */
+static uint32_t record_size(uint32_t topic_length, uint32_t payload_length)
+{
+    return (sizeof(record_header_t) + topic_length + payload_length + 7) & ~7UL;
+}
+
+/**
+ * @brief Returns the record at an offset if it is complete.
+ * @param data Pointer to the page contents.
+ * @param offset Offset of the record.
+ * @param limit End of the records in the page.
+ * @retval Pointer to the record header, NULL if there is no valid record.
+ */
+static record_header_t *record_at(uint8_t *data, uint32_t offset, uint32_t limit)
+{
+    if (offset + sizeof(record_header_t) > limit)
+    {
+        return NULL;
+    }
+    record_header_t *header = (record_header_t*) &data[offset];
+    if (header->magic != RECORD_MAGIC ||
+        offset + record_size(header->topic_length, header->payload_length) > limit ||
+        header->checksum != record_checksum(header))
+    {
+        return NULL;
+    }
+    return header;
+}
+
+/**
+ * @brief Programs double words from RAM into flash.
+ * @param address Flash address, 8-byte aligned.
+ * @param data Pointer to the data, 8-byte aligned.
+ * @param length Number of bytes, a multiple of 8.
+ */
+static void program(uint8_t *address, const uint8_t *data, uint32_t length)
+{
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    for (uint32_t i = 0; i < length; i += sizeof(uint64_t))
+    {
+        uint64_t value;
+        memcpy(&value, &data[i], sizeof(value));
+        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, (uintptr_t) &address[i], value) != HAL_OK)
+        {
+            break;
+        }
+    }
+    HAL_FLASH_Lock();
+}
+
+/**
+ * @brief Erases a page and makes it the page being written.
+ *
+ * See DMA_RECEPTION_BUFFER_SIZE in esp8266.c for the stall.
+ *
+ * @param page Page index within the region.
+ */
+static void start_page(uint32_t page)
+{
+    FLASH_EraseInitTypeDef erase = {0};
+    uint32_t page_error = 0;
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.Banks = FLASH_BANK_1;
+    erase.Page = ((uintptr_t) page_address(page) - FLASH_BASE) / FLASH_PAGE_SIZE;
+    erase.NbPages = 1;
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    HAL_FLASHEx_Erase(&erase, &page_error);
+    HAL_FLASH_Lock();
+
+    s_write_page = page;
+    s_write_sequence++;
+    memset(s_page_buffer, 0xFF, sizeof(s_page_buffer));
+    page_header_t *header = (page_header_t*) s_page;
+    header->magic = PAGE_MAGIC;
+    header->sequence = s_write_sequence;
+    s_write_offset = sizeof(page_header_t);
+    s_flushed_offset = 0; // Page header is programmed with the first records
+}
+
+/**
+ * @brief Moves writing to the next page, dropping the oldest page when the log is full.
+ */
+static void advance_write_page(void)
+{
+    uint32_t next = (s_write_page + 1) % page_count();
+    if (next == s_read_page)
+    {
+        // Log full, the unsent records of the oldest page are lost
+        uint8_t *data = page_address(next);
+        for (record_header_t *header = record_at(data, s_read_offset, FLASH_PAGE_SIZE); header != NULL;
+             header = record_at(data, s_read_offset, FLASH_PAGE_SIZE))
+        {
+            if (header->drained == DRAINED_PENDING)
+            {
+                s_pending--;
+            }
+            s_read_offset += record_size(header->topic_length, header->payload_length);
+        }
+        s_read_page = (next + 1) % page_count();
+        s_read_offset = sizeof(page_header_t);
+        for (uint32_t i = 0; i < UNCONFIRMED_SIZE; i++)
+        {
+            if (s_unconfirmed[i].used && s_unconfirmed[i].page == next)
+            {
+                s_unconfirmed[i].used = false; // Already counted as lost, must not be marked in the erased page
+            }
+        }
+        if (s_send_page == next)
+        {
+            s_send_page = s_read_page;
+            s_send_offset = s_read_offset;
+        }
+    }
+    start_page(next);
+}
+
+/**
+ * @brief Moves a position past the records already marked as sent.
+ * @param page Pointer to the page of the position.
+ * @param offset Pointer to the offset of the position.
+ * @retval Pointer to the first record not marked, NULL if every record is marked.
+ */
+static record_header_t *skip_drained(uint32_t *page, uint32_t *offset)
+{
+    while (true)
+    {
+        uint32_t limit = (*page == s_write_page) ? s_write_offset : FLASH_PAGE_SIZE;
+        record_header_t *header = record_at(page_data(*page), *offset, limit);
+        if (header != NULL)
+        {
+            if (header->drained == DRAINED_PENDING)
+            {
+                return header;
+            }
+            *offset += record_size(header->topic_length, header->payload_length);
+            continue;
+        }
+        if (*page == s_write_page)
+        {
+            return NULL;
+        }
+        *page = (*page + 1) % page_count();
+        *offset = sizeof(page_header_t);
+    }
+}
+
+/**
+ * @brief Marks a record as sent.
+ * @param page Page of the record.
+ * @param offset Offset of the record.
+ */
+static void mark_drained(uint32_t page, uint32_t offset)
+{
+    if (page != s_write_page || offset < s_flushed_offset)
+    {
+        static const uint64_t drained = 0;
+        program(&page_address(page)[offset + offsetof(record_header_t, drained)],
+                (const uint8_t*) &drained, sizeof(drained));
+    }
+    if (page == s_write_page)
+    {
+        ((record_header_t*) &s_page[offset])->drained = 0; // RAM copy, programmed with the page if not already
+    }
+    s_pending--;
+}
+
+/**
+ * @brief Ends the wait for a queued record.
+ * @param record Pointer to the unconfirmed record.
+ * @param success true if the record was delivered, false if it has to be sent again.
+ */
+static void confirm(unconfirmed_record_t *record, bool success)
+{
+    record->used = false;
+    if (success)
+    {
+        mark_drained(record->page, record->offset);
+    }
+    else
+    {
+        s_resend = true;
+    }
+}
+
+/**
+ * @brief Tells whether any queued record still waits for its confirmation.
+ * @retval true if a confirmation is due, false otherwise.
+ */
+static bool waiting_for_confirmation(void)
+{
+    for (uint32_t i = 0; i < UNCONFIRMED_SIZE; i++)
+    {
+        if (s_unconfirmed[i].used)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Returns a free slot for a queued record.
+ * @retval Pointer to the slot, NULL if every slot waits for a confirmation.
+ */
+static unconfirmed_record_t *free_unconfirmed(void)
+{
+    for (uint32_t i = 0; i < UNCONFIRMED_SIZE; i++)
+    {
+        if (!s_unconfirmed[i].used)
+        {
+            return &s_unconfirmed[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the write position and the oldest unsent record.
+ */
+void flash_log_init(void)
+{
+    memset(s_unconfirmed, 0, sizeof(s_unconfirmed));
+    s_resend = false;
+
+    int32_t newest = -1;
+    for (uint32_t page = 0; page < page_count(); page++)
+    {
+        const page_header_t *header = (const page_header_t*) page_address(page);
+        if (header->magic == PAGE_MAGIC &&
+            (newest < 0 || (int32_t)(header->sequence - s_write_sequence) > 0))
+        {
+            newest = page;
+            s_write_sequence = header->sequence;
+        }
+    }
+    s_pending = 0;
+    if (newest < 0)
+    {
+        s_write_sequence = 0;
+        start_page(0);
+        s_read_page = 0;
+        s_read_offset = s_write_offset;
+        s_send_page = s_read_page;
+        s_send_offset = s_read_offset;
+        return;
+    }
+
+    // Continue the newest page behind its last complete record
+    s_write_page = newest;
+    memcpy(s_page_buffer, page_address(newest), sizeof(s_page_buffer));
+    uint32_t offset = sizeof(page_header_t);
+    for (record_header_t *header = record_at(s_page, offset, FLASH_PAGE_SIZE); header != NULL;
+         header = record_at(s_page, offset, FLASH_PAGE_SIZE))
+    {
+        offset += record_size(header->topic_length, header->payload_length);
+    }
+    if (offset + sizeof(uint64_t) <= FLASH_PAGE_SIZE && *(const uint64_t*) &s_page[offset] != DRAINED_PENDING)
+    {
+        offset = FLASH_PAGE_SIZE; // Torn record, the rest of the page cannot be programmed
+    }
+    s_write_offset = offset;
+    s_flushed_offset = offset;
+
+    // Pages after the newest one are the older ones, oldest first
+    bool found = false;
+    for (uint32_t i = 1; i <= page_count(); i++)
+    {
+        uint32_t page = (newest + i) % page_count();
+        uint8_t *data = page_data(page);
+        if (((const page_header_t*) data)->magic != PAGE_MAGIC)
+        {
+            continue;
+        }
+        uint32_t limit = (page == s_write_page) ? s_write_offset : FLASH_PAGE_SIZE;
+        offset = sizeof(page_header_t);
+        for (record_header_t *header = record_at(data, offset, limit); header != NULL;
+             header = record_at(data, offset, limit))
+        {
+            if (header->drained == DRAINED_PENDING)
+            {
+                if (!found)
+                {
+                    s_read_page = page;
+                    s_read_offset = offset;
+                    found = true;
+                }
+                s_pending++;
+            }
+            offset += record_size(header->topic_length, header->payload_length);
+        }
+    }
+    if (!found)
+    {
+        s_read_page = s_write_page;
+        s_read_offset = s_write_offset;
+    }
+    s_send_page = s_read_page;
+    s_send_offset = s_read_offset;
+}
+
+/**
+ * @brief Appends a message to the log.
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload.
+ * @param payload_length Length of the payload.
+ * @param qos QoS the message is published with when drained, 0 or 1.
+ * @retval true if stored, false if the record is larger than a page.
+ */
+bool flash_log_append(const char *topic, uint16_t topic_length,
+                      const uint8_t *payload, uint16_t payload_length, uint8_t qos)
+{
+    uint32_t size = record_size(topic_length, payload_length);
+    if (size > FLASH_PAGE_SIZE - sizeof(page_header_t))
+    {
+        return false;
+    }
+    if (s_write_offset + size > FLASH_PAGE_SIZE)
+    {
+        flash_log_flush();
+        advance_write_page();
+    }
+
+    record_header_t *header = (record_header_t*) &s_page[s_write_offset];
+    header->magic = RECORD_MAGIC;
+    header->topic_length = topic_length;
+    header->payload_length = payload_length;
+    header->qos = qos;
+    header->drained = DRAINED_PENDING;
+    memcpy(header + 1, topic, topic_length);
+    memcpy((uint8_t*)(header + 1) + topic_length, payload, payload_length);
+    header->checksum = record_checksum(header);
+
+    if (s_write_offset == s_flushed_offset)
+    {
+        s_unflushed_tick = HAL_GetTick();
+    }
+    s_write_offset += size;
+    s_pending++;
+    return true;
+}
+
+/**
+ * @brief Programs the records collected in RAM into flash.
+ */
+void flash_log_flush(void)
+{
+    if (s_write_offset > s_flushed_offset && s_write_offset <= FLASH_PAGE_SIZE)
+    {
+        program(&page_address(s_write_page)[s_flushed_offset], &s_page[s_flushed_offset],
+                s_write_offset - s_flushed_offset);
+        s_flushed_offset = s_write_offset;
+    }
+}
+
+/**
+ * @brief Flushes on time and publishes stored records while online.
+ * @param online true if messages can be published.
+ */
+void flash_log_process(bool online)
+{
+    uint32_t now = HAL_GetTick();
+    if (s_write_offset > s_flushed_offset && now - s_unflushed_tick >= FLASH_LOG_FLUSH_INTERVAL)
+    {
+        flash_log_flush();
+    }
+    if (!online)
+    {
+        return;
+    }
+
+    if (now - s_drain_tick >= FLASH_LOG_DRAIN_PERIOD)
+    {
+        s_drain_tick = now;
+        s_drain_budget = FLASH_LOG_DRAIN_BURST;
+    }
+    skip_drained(&s_read_page, &s_read_offset);
+    if (s_resend)
+    {
+        if (waiting_for_confirmation())
+        {
+            return; // Results of the records queued after the failed one are still due
+        }
+        // Queue again from the oldest record not confirmed
+        s_send_page = s_read_page;
+        s_send_offset = s_read_offset;
+        s_resend = false;
+    }
+    record_header_t *header;
+    unconfirmed_record_t *record;
+    while (s_drain_budget > 0 && (record = free_unconfirmed()) != NULL &&
+           (header = skip_drained(&s_send_page, &s_send_offset)) != NULL)
+    {
+        const char *topic = (const char*)(header + 1);
+        stm_mqtt_segment_t payload = { (const uint8_t*) topic + header->topic_length, header->payload_length };
+        uint16_t packet_identifier = 0;
+        // In transparent transmission a send result only means the UART transfer ended,
+        // so QoS 0 records go with QoS 1 and wait for PUBACK
+        uint8_t qos = (header->qos == 0 && esp8266_is_passthrough()) ? 1 : header->qos;
+        bool queued = (qos > 0)
+            ? stm_mqtt_publish_segments_qos1(topic, header->topic_length, &payload, 1, &packet_identifier)
+            : stm_mqtt_publish_segments_qos0(topic, header->topic_length, &payload, 1);
+        if (!queued)
+        {
+            break; // Transmit queue or in-flight window full, retry later
+        }
+        record->used = true;
+        record->qos = qos;
+        record->packet_identifier = packet_identifier;
+        record->result_count = s_send_results + esp8266_queued_buffer_count(); // Queued last, reported last
+        record->page = s_send_page;
+        record->offset = s_send_offset;
+        s_send_offset += record_size(header->topic_length, header->payload_length);
+        s_drain_budget--;
+    }
+}
+
+/**
+ * @brief Returns the number of records not confirmed yet.
+ * @retval Number of pending records.
+ */
+uint32_t flash_log_pending(void)
+{
+    return s_pending;
+}
+
+/**
+ * @brief Confirms QoS 0 records with the result of a buffer sent by ESP8266.
+ * @param success true if ESP8266 sent the buffer.
+ */
+void flash_log_on_send_result(bool success)
+{
+    s_send_results++;
+    for (uint32_t i = 0; i < UNCONFIRMED_SIZE; i++)
+    {
+        if (s_unconfirmed[i].used && s_unconfirmed[i].qos == 0 && s_unconfirmed[i].result_count == s_send_results)
+        {
+            confirm(&s_unconfirmed[i], success);
+        }
+    }
+}
+
+/**
+ * @brief Confirms QoS 1 records on PUBACK.
+ *
+ * A PUBACK with a failure reason code or reported for a message the
+ * client dropped confirms the record as well, sending it again would
+ * fail the same way.
+ *
+ * @param event Pointer to the received packet.
+ */
+void flash_log_on_mqtt_event(const stm_mqtt_event_t *event)
+{
+    if (event->type != STM_MQTT_EVENT_PUBACK)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < UNCONFIRMED_SIZE; i++)
+    {
+        if (s_unconfirmed[i].used && s_unconfirmed[i].qos > 0 &&
+            s_unconfirmed[i].packet_identifier == event->packet_identifier)
+        {
+            confirm(&s_unconfirmed[i], true);
+        }
+    }
+}
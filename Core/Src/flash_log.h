@@ -0,0 +1,83 @@
+#ifndef _FLASH_LOG_H_
+#define _FLASH_LOG_H_
+
+/**
+ * @file    flash_log.h
+ * @brief   Store-and-forward log of outgoing MQTT messages in internal flash.
+ *
+ * Messages produced while the connection is down are appended to a ring of
+ * flash pages in the LOG region reserved by the linker script and published
+ * in order once the connection is back.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "stm_mqtt.h"
+
+#define FLASH_LOG_FLUSH_INTERVAL  30000 /**< Longest time in milliseconds a record waits in RAM before it is programmed */
+#define FLASH_LOG_DRAIN_BURST     4     /**< Records published per drain period */
+#define FLASH_LOG_DRAIN_PERIOD    100   /**< Drain period in milliseconds */
+
+/**
+ * @brief Finds the write position and the oldest unsent record, must be called once before use.
+ *
+ * Records sent are confirmed through flash_log_on_send_result() and
+ * flash_log_on_mqtt_event(), the application forwards the ESP8266 send
+ * results and the MQTT events to them.
+ */
+void flash_log_init(void);
+
+/**
+ * @brief Appends a message to the log.
+ *
+ * The record is collected in a RAM copy of the current page and programmed
+ * when the page is full, after FLASH_LOG_FLUSH_INTERVAL or on
+ * flash_log_flush(). When the log is full the oldest page is dropped.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload.
+ * @param payload_length Length of the payload.
+ * @param qos QoS the message is published with when drained, 0 or 1.
+ * @retval true if stored, false if the record is larger than a page.
+ */
+bool flash_log_append(const char *topic, uint16_t topic_length,
+                      const uint8_t *payload, uint16_t payload_length, uint8_t qos);
+
+/**
+ * @brief Programs the records collected in RAM into flash.
+ */
+void flash_log_flush(void);
+
+/**
+ * @brief Flushes on time and publishes stored records while online, must be called periodically from the main loop.
+ *
+ * At most FLASH_LOG_DRAIN_BURST records are published per
+ * FLASH_LOG_DRAIN_PERIOD so that live traffic keeps its share of the link.
+ * A record stays pending until PUBACK (QoS 1) or the ESP8266 send result
+ * (QoS 0) confirms it, and is published again if sending failed. During
+ * transparent transmission QoS 0 records are published with QoS 1.
+ *
+ * @param online true if messages can be published.
+ */
+void flash_log_process(bool online);
+
+/**
+ * @brief Returns the number of records not confirmed yet.
+ * @retval Number of pending records.
+ */
+uint32_t flash_log_pending(void);
+
+/**
+ * @brief Confirms QoS 0 records, to be called with every ESP8266 send result.
+ * @param success true if ESP8266 sent the buffer.
+ */
+void flash_log_on_send_result(bool success);
+
+/**
+ * @brief Confirms QoS 1 records, to be called with every MQTT event.
+ * @param event Pointer to the received packet.
+ */
+void flash_log_on_mqtt_event(const stm_mqtt_event_t *event);
+
+#endif // _FLASH_LOG_H_
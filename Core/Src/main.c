@@ -22,6 +22,9 @@
 /* USER CODE BEGIN Includes */
 #include "esp8266.h"
 #include "stm_mqtt.h"
+#include "connection_manager.h"
+#include "flash_log.h"
+#include "telemetry_batch.h"
 #include <string.h>
 /* USER CODE END Includes */
 
@@ -37,22 +40,31 @@
 
 /* Private variables ---------------------------------------------------------*/
 UART_HandleTypeDef huart1;
+DMA_HandleTypeDef hdma_usart1_rx;
+DMA_HandleTypeDef hdma_usart1_tx;
 
 /* USER CODE BEGIN PV */
 
-char received_topic[128];       /**< Topic of the received MQTT message */
 char received_payload[128];     /**< Payload of the received MQTT message */
 const char *subscribed_topic = "topic2"; /**< MQTT topic to subscribe */
+bool subscription_pending = true; /**< No SUBACK yet, set at reset as the last run may have lost it */
+uint32_t subscription_attempt_tick = 0; /**< Time of the last SUBSCRIBE */
 
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_USART1_UART_Init(void);
 
 /* USER CODE BEGIN PFP */
-
+static void on_led_command(const stm_mqtt_event_t *event, void *context);
+static void on_mqtt_online(bool session_present);
+static void subscribe_commands(void);
+static bool on_telemetry_batch(const char *topic, const uint8_t *payload, uint16_t length);
+static void on_send_result(bool success);
+static void on_mqtt_event(const stm_mqtt_event_t *event);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -89,31 +101,42 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_USART1_UART_Init();
   /* USER CODE BEGIN 2 */
-
+  stm_mqtt_register_handler(subscribed_topic, on_led_command, NULL);
+
+  // Keep subscription and commands sent while offline at the broker
+  stm_mqtt_set_clean_session(false);
+
+  // MQTT 5 lets repeated telemetry topics travel as 2-byte topic aliases
+  stm_mqtt_set_protocol_version(STM_MQTT_PROTOCOL_5);
+
+  // Wi-Fi network and MQTT broker to stay connected to
+  const connection_manager_config_t connection_config = {
+    .essid = "DESKTOP-IBPU5MV 1627",
+    .password = "75S10m(1",
+    .broker_address = "192.168.137.1",
+    .broker_port = 1883,
+    .client_id = "client_01",
+    .keep_alive = 60,
+    .passthrough = true,
+    .passive_receive = true,
+    .online_callback = on_mqtt_online,
+  };
+  connection_manager_init(&connection_config);
+
+  // Resume the messages stored during an earlier outage, confirmed by the callbacks below
+  flash_log_init();
+  esp8266_set_send_callback(on_send_result);
+  stm_mqtt_set_event_callback(on_mqtt_event);
+
+  // Samples are sent in batches, see on_telemetry_batch()
+  telemetry_batch_init(on_telemetry_batch);
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
-  bool b_mqtt_connected = false;   /**< Flag indicating MQTT connection status */
-  bool b_mqtt_subscribed = false;  /**< Flag indicating MQTT subscription status */
-
-  // Attempt to connect to Wi-Fi network and MQTT broker
-  if (connect_to_network("DESKTOP-IBPU5MV 1627", "75S10m(1"))
-  {
-    if (stm_mqtt_connect("192.168.137.1", 1883, "client_01", 60))
-    {
-      b_mqtt_connected = true;
-
-      // Subscribe to MQTT topic
-      if (stm_mqtt_subscribe_qos0(subscribed_topic))
-      {
-        b_mqtt_subscribed = true;
-      }
-    }
-  }
-
   int counter = 0;  /**< Counter variable for periodic tasks */
   
   while (1)
@@ -121,40 +144,26 @@ int main(void)
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
-    if (b_mqtt_connected)
+    // Connects at boot and reconnects whatever layer drops
+    connection_manager_process();
+
+    // Sends stored messages once back online
+    flash_log_process(connection_manager_is_online());
+
+    // Retries a subscription the broker did not acknowledge
+    if (subscription_pending && connection_manager_is_online()
+        && HAL_GetTick() - subscription_attempt_tick >= 1000)
     {
-      if (b_mqtt_subscribed)
-      {
-        // Clear received buffers
-        memset(received_topic, 0, sizeof(received_topic));
-        memset(received_payload, 0, sizeof(received_payload));
-
-        // Parse received MQTT message
-        if (stm_mqtt_parse_received_buffer(received_topic, received_payload))
-        {
-          // Check if received topic matches subscribed topic
-          if (strcmp(received_topic, subscribed_topic) == 0)
-          {
-            // Control LED based on received payload
-            if (strcmp(received_payload, "LED_ON") == 0)
-            {
-              HAL_GPIO_WritePin(GPIOA, GPIO_PIN_5, GPIO_PIN_SET);
-            }
-            else if (strcmp(received_payload, "LED_OFF") == 0)
-            {
-              HAL_GPIO_WritePin(GPIOA, GPIO_PIN_5, GPIO_PIN_RESET);
-            }
-          }
-        }
-      }
-
-      // Publish MQTT message periodically
-      if (HAL_GetTick() > counter + 999)
-      {
-        counter = HAL_GetTick();
-        stm_mqtt_publish_qos0("topic1", "Hello from stm");
-      }
+      subscribe_commands();
     }
+
+    // Sample every 100 ms, the samples of one second travel in one message
+    if (HAL_GetTick() > counter + 99)
+    {
+      counter = HAL_GetTick();
+      telemetry_batch_add("topic1", (const uint8_t*) "Hello from stm", 14);
+    }
+    telemetry_batch_process();
     /* USER CODE END 3 */
   }
   /* USER CODE END WHILE */
@@ -243,6 +252,25 @@ static void MX_USART1_UART_Init(void)
 
 }
 
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Channel4_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+  /* DMA1_Channel5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
@@ -276,6 +304,109 @@ static void MX_GPIO_Init(void)
 
 /* USER CODE BEGIN 4 */
 
+/**
+  * @brief  Restores the subscription unless the broker kept it and acknowledged it before.
+  * @param  session_present true if the broker resumed the persistent session.
+  * @retval None
+  */
+static void on_mqtt_online(bool session_present)
+{
+  if (!session_present)
+  {
+    subscription_pending = true;
+  }
+  if (subscription_pending)
+  {
+    subscribe_commands();
+  }
+}
+
+/**
+  * @brief  Subscribes to the command topic, retried from the main loop until SUBACK grants it.
+  * @retval None
+  */
+static void subscribe_commands(void)
+{
+  // QoS 1 so that commands are queued by the broker while offline,
+  // received messages are handled in on_led_command()
+  const stm_mqtt_subscription_t subscription = { subscribed_topic, 1 };
+  subscription_attempt_tick = HAL_GetTick();
+  if (stm_mqtt_subscribe(&subscription, 1, NULL))
+  {
+    subscription_pending = false; // The persistent session keeps it from now on
+  }
+}
+
+/**
+  * @brief  Publishes a batch of samples, stored in flash while offline.
+  * @param  topic Topic of the batch.
+  * @param  payload Pointer to the samples.
+  * @param  length Length of the payload.
+  * @retval true if published or stored, false to retry later.
+  */
+static bool on_telemetry_batch(const char *topic, const uint8_t *payload, uint16_t length)
+{
+  // Keep the order: while stored messages remain, new ones go behind them
+  if (connection_manager_is_online() && flash_log_pending() == 0)
+  {
+    stm_mqtt_segment_t segment = { payload, length };
+    if (stm_mqtt_publish_segments_qos0(topic, strlen(topic), &segment, 1))
+    {
+      return true;
+    }
+  }
+  return flash_log_append(topic, strlen(topic), payload, length, 0);
+}
+
+/**
+  * @brief  Forwards the result of each buffer sent by ESP8266.
+  * @param  success true if ESP8266 sent the buffer.
+  * @retval None
+  */
+static void on_send_result(bool success)
+{
+  stm_mqtt_on_send_result(success);
+  flash_log_on_send_result(success);
+}
+
+/**
+  * @brief  Forwards received MQTT packets, PUBACK confirms stored messages.
+  * @param  event Pointer to the received packet.
+  * @retval None
+  */
+static void on_mqtt_event(const stm_mqtt_event_t *event)
+{
+  flash_log_on_mqtt_event(event);
+}
+
+/**
+  * @brief  Handles messages received on the subscribed topic.
+  * @param  event Pointer to the received PUBLISH.
+  * @param  context Unused.
+  * @retval None
+  */
+static void on_led_command(const stm_mqtt_event_t *event, void *context)
+{
+  if (event->payload_length >= sizeof(received_payload))
+  {
+    return;
+  }
+
+  // Copy payload as string, it is not null terminated
+  memcpy(received_payload, event->payload, event->payload_length);
+  received_payload[event->payload_length] = '\0';
+
+  // Control LED based on received payload
+  if (strcmp(received_payload, "LED_ON") == 0)
+  {
+    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_5, GPIO_PIN_SET);
+  }
+  else if (strcmp(received_payload, "LED_OFF") == 0)
+  {
+    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_5, GPIO_PIN_RESET);
+  }
+}
+
 /* USER CODE END 4 */
 
 /**
@@ -0,0 +1,218 @@
+/**
+ * @file    ring_buffer.c
+ * @brief   Lock-free single-producer/single-consumer byte ring buffer.
+ *
+ * Indices are 32-bit and only ever written by one side, so on a single
+ * Cortex-M core the aligned loads and stores are atomic and no locking is
+ * needed. The producer stores data before publishing the new head and the
+ * consumer reads data before publishing the new tail, a __DMB() before each
+ * index store keeps the compiler and the core from reordering them.
+ */
+
+#include "ring_buffer.h"
+#include <string.h>
+#include "stm32l4xx_hal.h"
+
+/**
+ * @brief Initializes a ring buffer over the given storage.
+ * @param ring Pointer to the ring buffer.
+ * @param storage Pointer to the backing storage.
+ * @param size Size of the storage, must be a power of two.
+ */
+void ring_buffer_init(ring_buffer_t *ring, uint8_t *storage, uint32_t size)
+{
+    ring->storage = storage;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+}
+
+/**
+ * @brief Returns the number of bytes available for reading.
+ * @param ring Pointer to the ring buffer.
+ * @retval Number of stored bytes.
+ */
+uint32_t ring_buffer_count(const ring_buffer_t *ring)
+{
+    return ring->head - ring->tail;
+}
+
+/**
+ * @brief Returns the number of bytes that can still be written.
+ * @param ring Pointer to the ring buffer.
+ * @retval Number of free bytes.
+ */
+uint32_t ring_buffer_space(const ring_buffer_t *ring)
+{
+    return (ring->mask + 1) - ring_buffer_count(ring);
+}
+
+/**
+ * @brief Writes bytes into the ring buffer (producer side).
+ * @param ring Pointer to the ring buffer.
+ * @param data Pointer to the data to be written.
+ * @param length Number of bytes to write.
+ * @retval Number of bytes written, bytes that do not fit are dropped.
+ */
+uint32_t ring_buffer_write(ring_buffer_t *ring, const uint8_t *data, uint32_t length)
+{
+    uint32_t head = ring->head;
+    uint32_t space = (ring->mask + 1) - (head - ring->tail);
+    if (length > space)
+    {
+        ring->dropped += length - space;
+        length = space;
+    }
+
+    uint32_t start = head & ring->mask;
+    uint32_t first_part = (ring->mask + 1) - start;
+    if (first_part > length)
+    {
+        first_part = length;
+    }
+    memcpy(&ring->storage[start], data, first_part);
+    memcpy(ring->storage, &data[first_part], length - first_part);
+
+    __DMB(); // Data stored before the consumer sees the new head
+    ring->head = head + length;
+    return length;
+}
+
+/**
+ * @brief Reads a single byte at an offset from the read index without consuming it.
+ * @param ring Pointer to the ring buffer.
+ * @param offset Offset from the oldest stored byte.
+ * @param byte Pointer to store the byte.
+ * @retval true if a byte exists at the offset, false otherwise.
+ */
+bool ring_buffer_peek(const ring_buffer_t *ring, uint32_t offset, uint8_t *byte)
+{
+    if (offset >= ring_buffer_count(ring))
+    {
+        return false;
+    }
+    *byte = ring->storage[(ring->tail + offset) & ring->mask];
+    return true;
+}
+
+/**
+ * @brief Copies a range of bytes without consuming them.
+ * @param ring Pointer to the ring buffer.
+ * @param offset Offset from the oldest stored byte.
+ * @param data Pointer to the destination buffer.
+ * @param length Number of bytes to copy.
+ * @retval Number of bytes copied.
+ */
+uint32_t ring_buffer_peek_range(const ring_buffer_t *ring, uint32_t offset, uint8_t *data, uint32_t length)
+{
+    uint32_t count = ring_buffer_count(ring);
+    if (offset >= count)
+    {
+        return 0;
+    }
+    if (length > count - offset)
+    {
+        length = count - offset;
+    }
+
+    uint32_t start = (ring->tail + offset) & ring->mask;
+    uint32_t first_part = (ring->mask + 1) - start;
+    if (first_part > length)
+    {
+        first_part = length;
+    }
+    memcpy(data, &ring->storage[start], first_part);
+    memcpy(&data[first_part], ring->storage, length - first_part);
+    return length;
+}
+
+/**
+ * @brief Searches the stored bytes for a pattern without consuming them.
+ * @param ring Pointer to the ring buffer.
+ * @param offset Offset from the oldest stored byte where the search starts.
+ * @param pattern Pointer to the pattern.
+ * @param length Length of the pattern.
+ * @retval Offset of the first match, -1 if the pattern is not stored.
+ */
+int32_t ring_buffer_find(const ring_buffer_t *ring, uint32_t offset, const uint8_t *pattern, uint32_t length)
+{
+    uint32_t count = ring_buffer_count(ring);
+    uint32_t tail = ring->tail;
+    for (uint32_t i = offset; i + length <= count; i++)
+    {
+        uint32_t matched = 0;
+        while (matched < length && ring->storage[(tail + i + matched) & ring->mask] == pattern[matched])
+        {
+            matched++;
+        }
+        if (matched == length)
+        {
+            return (int32_t) i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns the contiguous block of stored bytes starting at the read index.
+ *
+ * Used to hand the stored data to DMA without copying. When the data wraps
+ * around the end of the storage, only the first part is returned.
+ *
+ * @param ring Pointer to the ring buffer.
+ * @param data Pointer to store the address of the block.
+ * @retval Length of the contiguous block.
+ */
+uint32_t ring_buffer_peek_linear(const ring_buffer_t *ring, const uint8_t **data)
+{
+    uint32_t count = ring_buffer_count(ring);
+    uint32_t start = ring->tail & ring->mask;
+    uint32_t first_part = (ring->mask + 1) - start;
+    *data = &ring->storage[start];
+    return (count < first_part) ? count : first_part;
+}
+
+/**
+ * @brief Copies bytes out of the ring buffer and consumes them (consumer side).
+ * @param ring Pointer to the ring buffer.
+ * @param data Pointer to the destination buffer.
+ * @param length Maximum number of bytes to read.
+ * @retval Number of bytes read.
+ */
+uint32_t ring_buffer_read(ring_buffer_t *ring, uint8_t *data, uint32_t length)
+{
+    length = ring_buffer_peek_range(ring, 0, data, length);
+    __DMB(); // Data copied out before the producer may overwrite it
+    ring->tail += length;
+    return length;
+}
+
+/**
+ * @brief Consumes bytes without copying them (consumer side).
+ * @param ring Pointer to the ring buffer.
+ * @param length Number of bytes to discard, limited to the stored count.
+ */
+void ring_buffer_discard(ring_buffer_t *ring, uint32_t length)
+{
+    uint32_t count = ring_buffer_count(ring);
+    if (length > count)
+    {
+        length = count;
+    }
+    __DMB(); // Bytes peeked by the caller are read before they are released
+    ring->tail += length;
+}
+
+/**
+ * @brief Discards every byte stored at the time of the call (consumer side).
+ *
+ * Bytes written by the producer after the head snapshot are kept.
+ *
+ * @param ring Pointer to the ring buffer.
+ */
+void ring_buffer_flush(ring_buffer_t *ring)
+{
+    __DMB();
+    ring->tail = ring->head;
+}
@@ -0,0 +1,131 @@
+#ifndef _RING_BUFFER_H_
+#define _RING_BUFFER_H_
+
+/**
+ * @file    ring_buffer.h
+ * @brief   Lock-free single-producer/single-consumer byte ring buffer.
+ *
+ * The producer (typically an interrupt handler) only writes the head index,
+ * the consumer (typically the main loop) only writes the tail index. Both
+ * indices are free-running and wrapped with a mask, so the storage size must
+ * be a power of two.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**
+ * @brief Ring buffer control structure.
+ */
+typedef struct
+{
+    uint8_t *storage;        /**< Backing storage */
+    uint32_t mask;           /**< Storage size - 1 */
+    volatile uint32_t head;  /**< Free-running write index, owned by producer */
+    volatile uint32_t tail;  /**< Free-running read index, owned by consumer */
+    volatile uint32_t dropped; /**< Number of bytes dropped because buffer was full */
+} ring_buffer_t;
+
+/**
+ * @brief Static initializer for a ring buffer over a power-of-two sized array.
+ */
+#define RING_BUFFER_STATIC_INIT(storage_array) { (storage_array), sizeof(storage_array) - 1, 0, 0, 0 }
+
+/**
+ * @brief Initializes a ring buffer over the given storage.
+ * @param ring Pointer to the ring buffer.
+ * @param storage Pointer to the backing storage.
+ * @param size Size of the storage, must be a power of two.
+ */
+void ring_buffer_init(ring_buffer_t *ring, uint8_t *storage, uint32_t size);
+
+/**
+ * @brief Returns the number of bytes available for reading.
+ * @param ring Pointer to the ring buffer.
+ * @retval Number of stored bytes.
+ */
+uint32_t ring_buffer_count(const ring_buffer_t *ring);
+
+/**
+ * @brief Returns the number of bytes that can still be written.
+ * @param ring Pointer to the ring buffer.
+ * @retval Number of free bytes.
+ */
+uint32_t ring_buffer_space(const ring_buffer_t *ring);
+
+/**
+ * @brief Writes bytes into the ring buffer (producer side).
+ * @param ring Pointer to the ring buffer.
+ * @param data Pointer to the data to be written.
+ * @param length Number of bytes to write.
+ * @retval Number of bytes written, bytes that do not fit are dropped.
+ */
+uint32_t ring_buffer_write(ring_buffer_t *ring, const uint8_t *data, uint32_t length);
+
+/**
+ * @brief Reads a single byte at an offset from the read index without consuming it.
+ * @param ring Pointer to the ring buffer.
+ * @param offset Offset from the oldest stored byte.
+ * @param byte Pointer to store the byte.
+ * @retval true if a byte exists at the offset, false otherwise.
+ */
+bool ring_buffer_peek(const ring_buffer_t *ring, uint32_t offset, uint8_t *byte);
+
+/**
+ * @brief Copies a range of bytes without consuming them.
+ * @param ring Pointer to the ring buffer.
+ * @param offset Offset from the oldest stored byte.
+ * @param data Pointer to the destination buffer.
+ * @param length Number of bytes to copy.
+ * @retval Number of bytes copied.
+ */
+uint32_t ring_buffer_peek_range(const ring_buffer_t *ring, uint32_t offset, uint8_t *data, uint32_t length);
+
+/**
+ * @brief Searches the stored bytes for a pattern without consuming them.
+ * @param ring Pointer to the ring buffer.
+ * @param offset Offset from the oldest stored byte where the search starts.
+ * @param pattern Pointer to the pattern.
+ * @param length Length of the pattern.
+ * @retval Offset of the first match, -1 if the pattern is not stored.
+ */
+int32_t ring_buffer_find(const ring_buffer_t *ring, uint32_t offset, const uint8_t *pattern, uint32_t length);
+
+/**
+ * @brief Returns the contiguous block of stored bytes starting at the read index.
+ *
+ * Used to hand the stored data to DMA without copying. When the data wraps
+ * around the end of the storage, only the first part is returned.
+ *
+ * @param ring Pointer to the ring buffer.
+ * @param data Pointer to store the address of the block.
+ * @retval Length of the contiguous block.
+ */
+uint32_t ring_buffer_peek_linear(const ring_buffer_t *ring, const uint8_t **data);
+
+/**
+ * @brief Copies bytes out of the ring buffer and consumes them (consumer side).
+ * @param ring Pointer to the ring buffer.
+ * @param data Pointer to the destination buffer.
+ * @param length Maximum number of bytes to read.
+ * @retval Number of bytes read.
+ */
+uint32_t ring_buffer_read(ring_buffer_t *ring, uint8_t *data, uint32_t length);
+
+/**
+ * @brief Consumes bytes without copying them (consumer side).
+ * @param ring Pointer to the ring buffer.
+ * @param length Number of bytes to discard, limited to the stored count.
+ */
+void ring_buffer_discard(ring_buffer_t *ring, uint32_t length);
+
+/**
+ * @brief Discards every byte stored at the time of the call (consumer side).
+ *
+ * Bytes written by the producer after the head snapshot are kept.
+ *
+ * @param ring Pointer to the ring buffer.
+ */
+void ring_buffer_flush(ring_buffer_t *ring);
+
+#endif // _RING_BUFFER_H_
@@ -0,0 +1,256 @@
+/**
+ * @file    session_store.c
+ * @brief   Small record kept in internal flash across resets.
+ *
+ * Each copy occupies a fixed slot of SLOT_SIZE bytes: a header with a
+ * sequence number and checksum followed by the record. Slots are programmed
+ * with 64-bit double words as the STM32L4 flash requires. Loading scans
+ * every page for the valid slot with the highest sequence number and saving
+ * writes the slot after it, erasing the next page of the ring when the
+ * current one is full.
+ *
+ * The 16 KB region holds 8 pages of 32 slots, so each page is erased once
+ * per 256 saves. With 10k erase cycles per page that is about 2.5 million
+ * saves. A QoS 2 exchange saves twice (received then released, or PUBREL
+ * then PUBCOMP), which allows about 1.2 million QoS 2 messages.
+ */
+
+#include "session_store.h"
+#include "stm32l4xx_hal.h"
+#include <string.h>
+
+#define SESSION_MAGIC   0x53455353 /**< "SESS", marks a programmed slot */
+#define SLOT_SIZE       64         /**< Header and record, multiple of 8 */
+#define SLOTS_PER_PAGE  (FLASH_PAGE_SIZE / SLOT_SIZE)
+
+extern uint8_t _session_flash_start[]; /**< Start of SESSION region, from the linker script */
+extern uint8_t _session_flash_end[];   /**< End of SESSION region, from the linker script */
+
+/**
+ * @brief Header in front of every stored copy
+ */
+typedef struct
+{
+    uint32_t magic;      /**< SESSION_MAGIC */
+    uint32_t sequence;   /**< Incremented with every save */
+    uint16_t length;     /**< Length of the record */
+    uint16_t checksum;   /**< CRC-16 of sequence, length and record */
+} slot_header_t;
+
+static int32_t s_last_slot = -1;   /**< Index of the newest valid slot, -1 if none or not scanned */
+static uint32_t s_last_sequence = 0; /**< Sequence number of the newest valid slot */
+static bool s_scanned = false;     /**< Slots were scanned since reset */
+
+/**
+ * @brief Computes CRC-16/CCITT over a buffer.
+ * @param crc Initial value or result of the previous part.
+ * @param data Pointer to the data.
+ * @param length Number of bytes.
+ * @retval Updated CRC.
+ */
+static uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t length)
+{
+    while (length-- > 0)
+    {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * @brief Returns the number of pages in the SESSION region.
+ * @retval Number of pages.
+ */
+static uint32_t page_count(void)
+{
+    return (uint32_t)(_session_flash_end - _session_flash_start) / FLASH_PAGE_SIZE;
+}
+
+/**
+ * @brief Returns the address of a slot.
+ * @param slot Slot index over all pages.
+ * @retval Pointer to the slot in flash.
+ */
+static const uint8_t *slot_address(uint32_t slot)
+{
+    return &_session_flash_start[slot * SLOT_SIZE];
+}
+
+/**
+ * @brief Computes the checksum of a slot.
+ * @param header Pointer to the slot header.
+ * @param record Pointer to the record.
+ * @retval Checksum.
+ */
+static uint16_t slot_checksum(const slot_header_t *header, const uint8_t *record)
+{
+    uint16_t crc = crc16(0xFFFF, (const uint8_t*) &header->sequence, sizeof(header->sequence));
+    crc = crc16(crc, (const uint8_t*) &header->length, sizeof(header->length));
+    return crc16(crc, record, header->length);
+}
+
+/**
+ * @brief Tells whether a slot holds a complete copy.
+ * @param slot Slot index over all pages.
+ * @retval true if valid, false if erased or torn.
+ */
+static bool slot_is_valid(uint32_t slot)
+{
+    const slot_header_t *header = (const slot_header_t*) slot_address(slot);
+    return header->magic == SESSION_MAGIC &&
+           header->length <= SESSION_STORE_MAX_SIZE &&
+           header->checksum == slot_checksum(header, slot_address(slot) + sizeof(slot_header_t));
+}
+
+/**
+ * @brief Tells whether a slot is still erased.
+ * @param slot Slot index over all pages.
+ * @retval true if every byte reads 0xFF, false otherwise.
+ */
+static bool slot_is_blank(uint32_t slot)
+{
+    const uint32_t *word = (const uint32_t*) slot_address(slot);
+    for (uint32_t i = 0; i < SLOT_SIZE / sizeof(uint32_t); i++)
+    {
+        if (word[i] != 0xFFFFFFFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Finds the newest valid slot, once after reset.
+ */
+static void scan_slots(void)
+{
+    if (s_scanned)
+    {
+        return;
+    }
+    for (uint32_t slot = 0; slot < page_count() * SLOTS_PER_PAGE; slot++)
+    {
+        const slot_header_t *header = (const slot_header_t*) slot_address(slot);
+        if (slot_is_valid(slot) && (s_last_slot < 0 || (int32_t)(header->sequence - s_last_sequence) > 0))
+        {
+            s_last_slot = slot;
+            s_last_sequence = header->sequence;
+        }
+    }
+    s_scanned = true;
+}
+
+/**
+ * @brief Erases one page of the SESSION region.
+ *
+ * See DMA_RECEPTION_BUFFER_SIZE in esp8266.c for the stall.
+ *
+ * @param page Page index within the region.
+ * @retval true if erased, false otherwise.
+ */
+static bool erase_page(uint32_t page)
+{
+    FLASH_EraseInitTypeDef erase = {0};
+    uint32_t page_error = 0;
+    erase.TypeErase = FLASH_TYPEERASE_PAGES;
+    erase.Banks = FLASH_BANK_1;
+    erase.Page = ((uintptr_t) _session_flash_start - FLASH_BASE) / FLASH_PAGE_SIZE + page;
+    erase.NbPages = 1;
+    return HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+}
+
+/**
+ * @brief Loads the newest valid copy of the record.
+ * @param data Pointer to the destination buffer.
+ * @param length Expected length of the record, at most SESSION_STORE_MAX_SIZE.
+ * @retval true if a valid copy with the expected length was found, false otherwise.
+ */
+bool session_store_load(void *data, uint16_t length)
+{
+    scan_slots();
+    if (s_last_slot < 0)
+    {
+        return false;
+    }
+    const slot_header_t *header = (const slot_header_t*) slot_address(s_last_slot);
+    if (header->length != length)
+    {
+        return false; // Record layout changed, start over
+    }
+    memcpy(data, slot_address(s_last_slot) + sizeof(slot_header_t), length);
+    return true;
+}
+
+/**
+ * @brief Appends a new copy of the record.
+ * @param data Pointer to the record.
+ * @param length Length of the record, at most SESSION_STORE_MAX_SIZE.
+ * @retval true if written and verified, false on a flash error.
+ */
+bool session_store_save(const void *data, uint16_t length)
+{
+    if (length > SESSION_STORE_MAX_SIZE)
+    {
+        return false;
+    }
+    scan_slots();
+
+    uint32_t slot = (s_last_slot < 0) ? 0 : (uint32_t)(s_last_slot + 1) % (page_count() * SLOTS_PER_PAGE);
+    if (slot % SLOTS_PER_PAGE != 0 && !slot_is_blank(slot))
+    {
+        // A torn write left the slot programmed, continue on the next page
+        slot = (slot / SLOTS_PER_PAGE + 1) % page_count() * SLOTS_PER_PAGE;
+    }
+    uint64_t image[SLOT_SIZE / sizeof(uint64_t)];
+    memset(image, 0xFF, sizeof(image));
+    slot_header_t *header = (slot_header_t*) image;
+    header->magic = SESSION_MAGIC;
+    header->sequence = s_last_sequence + 1;
+    header->length = length;
+    memcpy((uint8_t*) image + sizeof(slot_header_t), data, length);
+    header->checksum = slot_checksum(header, (const uint8_t*) image + sizeof(slot_header_t));
+
+    bool result = true;
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    if (slot % SLOTS_PER_PAGE == 0)
+    {
+        // Entering a page, the copies left in it are older than the current one
+        result = erase_page(slot / SLOTS_PER_PAGE);
+    }
+    uint32_t address = (uintptr_t) slot_address(slot);
+    for (uint32_t i = 0; result && i < SLOT_SIZE / sizeof(uint64_t); i++)
+    {
+        result = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address + i * sizeof(uint64_t), image[i]) == HAL_OK;
+    }
+    HAL_FLASH_Lock();
+
+    if (result && slot_is_valid(slot))
+    {
+        s_last_slot = slot;
+        s_last_sequence = header->sequence;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Erases every copy of the record.
+ */
+void session_store_erase(void)
+{
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ALL_ERRORS);
+    for (uint32_t page = 0; page < page_count(); page++)
+    {
+        erase_page(page);
+    }
+    HAL_FLASH_Lock();
+    s_last_slot = -1;
+    s_scanned = true;
+}
@@ -0,0 +1,41 @@
+#ifndef _SESSION_STORE_H_
+#define _SESSION_STORE_H_
+
+/**
+ * @file    session_store.h
+ * @brief   Small record kept in internal flash across resets.
+ *
+ * The record lives in the SESSION region reserved by the linker script.
+ * Every save appends a new copy behind the previous one, so a page is only
+ * erased after it has been filled with copies, and the pages are used in
+ * turn. A copy torn by a reset fails its checksum and the previous one is
+ * loaded instead.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define SESSION_STORE_MAX_SIZE 52 /**< Largest record that can be stored, in bytes */
+
+/**
+ * @brief Loads the newest valid copy of the record.
+ * @param data Pointer to the destination buffer.
+ * @param length Expected length of the record, at most SESSION_STORE_MAX_SIZE.
+ * @retval true if a valid copy with the expected length was found, false otherwise.
+ */
+bool session_store_load(void *data, uint16_t length);
+
+/**
+ * @brief Appends a new copy of the record.
+ * @param data Pointer to the record.
+ * @param length Length of the record, at most SESSION_STORE_MAX_SIZE.
+ * @retval true if written and verified, false on a flash error.
+ */
+bool session_store_save(const void *data, uint16_t length);
+
+/**
+ * @brief Erases every copy of the record.
+ */
+void session_store_erase(void);
+
+#endif // _SESSION_STORE_H_
@@ -1,61 +1,1422 @@
 #include "stm_mqtt.h"
 #include "esp8266.h"
+#include "session_store.h"
 #include <string.h>
 #include "stm32l4xx_hal.h"
 
-#define TRANSMIT_BUFFER_SIZE 128
+#define TRANSMIT_BUFFER_SIZE  ESP8266_MAX_SEND_SIZE /**< Largest packet that fits into one AT+CIPSEND */
+#define FIXED_HEADER_MAX_SIZE 5    /**< Packet type byte and up to 4 Remaining Length bytes */
+#define TRANSMIT_TIMEOUT      1000 /**< Time to wait for a packet to leave the transmit queue */
+#define RESPONSE_TIMEOUT      1000 /**< Time to wait for CONNACK or SUBACK */
+#define RECEIVE_PACKET_SIZE   2048 /**< Largest received packet that is delivered, larger ones are skipped */
 static uint8_t s_transmit_buffer[TRANSMIT_BUFFER_SIZE];
 
-static uint8_t s_package_identifier_count = 1;
+static uint16_t s_package_identifier_count = 1;
 
 /**
- * @brief Checks if the CONNACK message is received.
- * @retval true if CONNACK message is received, false otherwise.
+ * @brief States of the received packet decoder
  */
-static bool is_connact_received(void)
+typedef enum
 {
-    int remaining_bytes = 0;
-    for (uint16_t i = 0; i < sizeof(g_reception_buffer); i++)
+    DECODER_FIXED_HEADER,     /**< Waiting for packet type and flags */
+    DECODER_REMAINING_LENGTH, /**< Decoding the variable length Remaining Length field */
+    DECODER_BODY,             /**< Collecting variable header and payload */
+    DECODER_SKIP              /**< Dropping the body of a packet that does not fit */
+} decoder_state_t;
+
+/**
+ * @brief Resumable decoder of the received TCP byte stream
+ */
+typedef struct
+{
+    decoder_state_t state;       /**< Decoder state */
+    uint8_t header;              /**< First byte of the fixed header */
+    uint32_t remaining_length;   /**< Decoded Remaining Length */
+    uint32_t multiplier;         /**< Weight of the next Remaining Length byte */
+    uint32_t received;           /**< Body bytes collected or skipped so far */
+} packet_decoder_t;
+
+static packet_decoder_t s_decoder = { DECODER_FIXED_HEADER, 0, 0, 1, 0 };
+static uint8_t s_receive_packet[RECEIVE_PACKET_SIZE]; /**< Body of the packet being decoded */
+static stm_mqtt_event_callback_t s_event_callback = NULL;
+
+static bool s_connack_received = false;  /**< CONNACK received since CONNECT was sent */
+static uint8_t s_connack_return_code = 0; /**< Return code of the last CONNACK */
+static uint16_t s_suback_identifier = 0; /**< Packet identifier of the last SUBACK */
+static uint8_t *s_suback_return_codes = NULL; /**< Receives the return codes of the awaited SUBACK, may be NULL */
+static uint8_t s_suback_return_code_count = 0; /**< Number of return codes the awaited SUBACK carries */
+static bool s_suback_failed = false;      /**< Awaited SUBACK refused a filter */
+static uint16_t s_unsuback_identifier = 0; /**< Packet identifier of the last UNSUBACK */
+static bool s_session_active = false;    /**< Broker accepted the connection */
+static bool s_clean_session = true;      /**< Connect with Clean Session set */
+static bool s_session_present = false;   /**< CONNACK reported a stored session */
+static uint8_t s_protocol_version = STM_MQTT_PROTOCOL_3_1_1; /**< Protocol Level sent in CONNECT */
+static uint8_t s_reason_code = 0;        /**< Reported by stm_mqtt_last_reason_code() */
+static bool s_unsuback_failed = false;   /**< Awaited MQTT 5 UNSUBACK refused a filter */
+
+static uint16_t s_server_receive_maximum = 0xFFFF;         /**< QoS 1 and 2 messages the broker accepts unacknowledged */
+static uint32_t s_server_maximum_packet_size = 0xFFFFFFFF; /**< Largest packet the broker accepts */
+static uint16_t s_server_topic_alias_maximum = 0;          /**< Highest topic alias the broker accepts */
+
+/**
+ * @brief Topic a topic alias stands for
+ */
+typedef struct
+{
+    uint16_t length;                          /**< Topic length, 0 if the alias is not set */
+    char topic[STM_MQTT_TOPIC_ALIAS_LENGTH];  /**< Topic, not null terminated */
+    bool announced;                           /**< Outbound only, a PUBLISH carrying topic and alias was sent */
+    uint32_t result_count;                    /**< Outbound only, value of s_send_results when that PUBLISH is reported */
+} topic_alias_t;
+
+static topic_alias_t s_outbound_aliases[STM_MQTT_TOPIC_ALIASES]; /**< Aliases 1.. assigned on this connection */
+static uint16_t s_outbound_alias_count = 0;                     /**< Number of assigned outbound aliases */
+static topic_alias_t s_inbound_aliases[STM_MQTT_TOPIC_ALIASES];  /**< Aliases 1.. set by the broker on this connection */
+static uint32_t s_send_results = 0;                             /**< ESP8266 send results reported so far */
+
+/**
+ * @brief Encoding of an MQTT 5 property value
+ */
+typedef enum
+{
+    PROPERTY_BYTE,       /**< One byte integer */
+    PROPERTY_UINT16,     /**< Two byte integer */
+    PROPERTY_UINT32,     /**< Four byte integer */
+    PROPERTY_VARIABLE,   /**< Variable byte integer */
+    PROPERTY_BINARY,     /**< Length-prefixed string or binary data */
+    PROPERTY_PAIR,       /**< Two length-prefixed strings */
+    PROPERTY_INVALID     /**< Unknown identifier */
+} property_type_t;
+
+static uint32_t s_keep_alive_interval = 0; /**< Keep alive in milliseconds, 0 if disabled */
+static uint32_t s_last_transmit_tick = 0;  /**< Time the last packet was queued */
+static uint32_t s_last_receive_tick = 0;   /**< Time data was last received from the broker */
+static uint32_t s_ping_tick = 0;           /**< Time the outstanding PINGREQ was queued */
+static bool s_ping_outstanding = false;    /**< PINGREQ sent, PINGRESP not received yet */
+static uint8_t s_missed_pings = 0;         /**< Consecutive PINGREQs without PINGRESP */
+static uint32_t s_ping_latency = 0;        /**< Round trip time of the last PINGREQ */
+
+/**
+ * @brief State of an in-flight outgoing PUBLISH
+ */
+typedef enum
+{
+    INFLIGHT_FREE,            /**< Slot unused */
+    INFLIGHT_AWAIT_PUBACK,    /**< QoS 1 PUBLISH sent, waiting for PUBACK */
+    INFLIGHT_AWAIT_PUBREC,    /**< QoS 2 PUBLISH sent, waiting for PUBREC */
+    INFLIGHT_AWAIT_PUBCOMP,   /**< QoS 2 PUBREL sent, waiting for PUBCOMP */
+    INFLIGHT_ACKNOWLEDGED     /**< Acknowledged, storage released once older slots are */
+} inflight_state_t;
+
+/**
+ * @brief An outgoing PUBLISH kept for retransmission until acknowledged
+ */
+typedef struct
+{
+    inflight_state_t state;       /**< Slot state */
+    uint16_t packet_identifier;   /**< Packet identifier */
+    uint32_t offset;              /**< Free-running position of the packet in s_inflight_ring */
+    uint16_t length;              /**< Packet length */
+    bool transmitted;             /**< PUBLISH or PUBREL queued for transmission at least once, later PUBLISH copies carry DUP */
+    uint32_t sent_tick;           /**< Time of the last (re)transmission */
+} inflight_message_t;
+
+static uint8_t s_inflight_storage[STM_MQTT_INFLIGHT_STORAGE_SIZE];
+static ring_buffer_t s_inflight_ring = RING_BUFFER_STATIC_INIT(s_inflight_storage); /**< Stored packets, oldest first */
+static inflight_message_t s_inflight[STM_MQTT_INFLIGHT_WINDOW];
+static uint8_t s_inflight_head = 0; /**< Index of next slot to be used */
+static uint8_t s_inflight_tail = 0; /**< Index of oldest used slot */
+
+static uint16_t s_received_qos2[STM_MQTT_QOS2_RECEIVE_SLOTS]; /**< Identifiers of QoS 2 messages received but not released, 0 if free */
+
+/**
+ * @brief Session state kept in flash while Clean Session is cleared
+ *
+ * Only packet identifiers are kept, which is what exactly-once delivery
+ * needs to survive a reset: received QoS 2 messages not yet released must
+ * not be delivered again, sent ones past PUBREC must be finished with
+ * PUBREL. Must not exceed SESSION_STORE_MAX_SIZE.
+ */
+typedef struct
+{
+    uint16_t received_qos2[STM_MQTT_QOS2_RECEIVE_SLOTS]; /**< Copy of s_received_qos2 */
+    uint16_t released_qos2[STM_MQTT_INFLIGHT_WINDOW];    /**< Sent QoS 2 messages waiting for PUBCOMP, 0 if free */
+} session_record_t;
+
+static session_record_t s_saved_session; /**< Record as last written to flash */
+
+#define TRIE_NONE 0xFF /**< Index that refers to no trie node */
+
+/**
+ * @brief A topic level of the subscription trie
+ *
+ * Children of a node are kept in a singly linked sibling list, level
+ * texts in a shared pool, so a filter costs one node per level that is
+ * not shared with another filter.
+ */
+typedef struct
+{
+    uint16_t text_offset;         /**< Position of the level text in s_trie_text */
+    uint8_t text_length;          /**< Length of the level text */
+    uint8_t first_child;          /**< Index of the first child, TRIE_NONE if leaf */
+    uint8_t next_sibling;         /**< Index of the next sibling, TRIE_NONE if last */
+    stm_mqtt_message_handler_t handler; /**< Handler of the filter ending here, NULL if none */
+    void *context;                /**< Passed to handler */
+} trie_node_t;
+
+static trie_node_t s_trie[STM_MQTT_TRIE_NODES] = { { 0, 0, TRIE_NONE, TRIE_NONE, NULL, NULL } }; /**< Node 0 is the root */
+static uint8_t s_trie_node_count = 1;
+static char s_trie_text[STM_MQTT_TRIE_TEXT_SIZE]; /**< Level texts of all nodes */
+static uint16_t s_trie_text_size = 0;
+
+/**
+ * @brief Queues a packet gathered from segments and restarts the keep alive period.
+ * @param segments Pointer to the segments, in sending order.
+ * @param segment_count Number of segments.
+ * @retval true if queued for transmission, false if the transmit queue is full.
+ */
+static bool transmit_segments(const esp8266_segment_t *segments, uint8_t segment_count)
+{
+    if (!send_segments(segments, segment_count))
+    {
+        return false;
+    }
+    s_last_transmit_tick = HAL_GetTick();
+    return true;
+}
+
+/**
+ * @brief Queues a contiguous packet and restarts the keep alive period.
+ * @param packet Pointer to the packet.
+ * @param length Length of the packet.
+ * @retval true if queued for transmission, false if the transmit queue is full.
+ */
+static bool transmit(const uint8_t *packet, uint16_t length)
+{
+    esp8266_segment_t segment = { packet, length };
+    return transmit_segments(&segment, 1);
+}
+
+/**
+ * @brief Sends a packet that consists of a fixed header and a packet identifier.
+ * @param header First byte of the fixed header.
+ * @param packet_identifier Packet identifier.
+ * @retval true if queued for transmission, false if the transmit queue is full.
+ */
+static bool send_acknowledgement(uint8_t header, uint16_t packet_identifier)
+{
+    uint8_t packet[4] = { header, 2, packet_identifier >> 8, packet_identifier & 0xFF };
+    return transmit(packet, sizeof(packet));
+}
+
+/**
+ * @brief Reads a big-endian 16-bit value.
+ * @param data Pointer to the value.
+ * @retval Decoded value.
+ */
+static uint16_t read_uint16(const uint8_t *data)
+{
+    return (uint16_t)((data[0] << 8) | data[1]);
+}
+
+/**
+ * @brief Reads an MQTT variable byte integer.
+ * @param data Pointer to the buffer.
+ * @param length Length of the buffer.
+ * @param offset Pointer to the position of the integer, advanced past it.
+ * @param value Pointer to receive the decoded value.
+ * @retval true if decoded, false if the integer is truncated or longer than 4 bytes.
+ */
+static bool read_variable_integer(const uint8_t *data, uint32_t length, uint32_t *offset, uint32_t *value)
+{
+    *value = 0;
+    for (uint8_t i = 0; i < 4 && *offset < length; i++)
+    {
+        uint8_t byte = data[(*offset)++];
+        *value |= (uint32_t)(byte & 0x7F) << (7 * i);
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Returns how the value of a property is encoded.
+ * @param identifier Property identifier.
+ * @retval Value encoding, PROPERTY_INVALID for an unknown identifier.
+ */
+static property_type_t property_type(uint8_t identifier)
+{
+    switch (identifier)
+    {
+    case STM_MQTT_PROPERTY_PAYLOAD_FORMAT_INDICATOR:
+    case STM_MQTT_PROPERTY_REQUEST_PROBLEM_INFORMATION:
+    case STM_MQTT_PROPERTY_REQUEST_RESPONSE_INFORMATION:
+    case STM_MQTT_PROPERTY_MAXIMUM_QOS:
+    case STM_MQTT_PROPERTY_RETAIN_AVAILABLE:
+    case STM_MQTT_PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE:
+    case STM_MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE:
+    case STM_MQTT_PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE:
+        return PROPERTY_BYTE;
+    case STM_MQTT_PROPERTY_SERVER_KEEP_ALIVE:
+    case STM_MQTT_PROPERTY_RECEIVE_MAXIMUM:
+    case STM_MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM:
+    case STM_MQTT_PROPERTY_TOPIC_ALIAS:
+        return PROPERTY_UINT16;
+    case STM_MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL:
+    case STM_MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL:
+    case STM_MQTT_PROPERTY_WILL_DELAY_INTERVAL:
+    case STM_MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+        return PROPERTY_UINT32;
+    case STM_MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER:
+        return PROPERTY_VARIABLE;
+    case STM_MQTT_PROPERTY_CONTENT_TYPE:
+    case STM_MQTT_PROPERTY_RESPONSE_TOPIC:
+    case STM_MQTT_PROPERTY_CORRELATION_DATA:
+    case STM_MQTT_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER:
+    case STM_MQTT_PROPERTY_AUTHENTICATION_METHOD:
+    case STM_MQTT_PROPERTY_AUTHENTICATION_DATA:
+    case STM_MQTT_PROPERTY_RESPONSE_INFORMATION:
+    case STM_MQTT_PROPERTY_SERVER_REFERENCE:
+    case STM_MQTT_PROPERTY_REASON_STRING:
+        return PROPERTY_BINARY;
+    case STM_MQTT_PROPERTY_USER_PROPERTY:
+        return PROPERTY_PAIR;
+    default:
+        return PROPERTY_INVALID;
+    }
+}
+
+/**
+ * @brief Reads a length-prefixed string or binary field.
+ * @param data Pointer to the buffer.
+ * @param length Length of the buffer.
+ * @param offset Pointer to the position of the field, advanced past it.
+ * @param field Pointer to receive the start of the field data.
+ * @param field_length Pointer to receive the length of the field data.
+ * @retval true if decoded, false if the field is truncated.
+ */
+static bool read_binary(const uint8_t *data, uint32_t length, uint32_t *offset,
+                        const uint8_t **field, uint16_t *field_length)
+{
+    if (*offset + 2 > length || *offset + 2 + read_uint16(&data[*offset]) > length)
+    {
+        return false;
+    }
+    *field_length = read_uint16(&data[*offset]);
+    *field = &data[*offset + 2];
+    *offset += 2 + *field_length;
+    return true;
+}
+
+/**
+ * @brief Reads one property from a property list.
+ * @param data Pointer to the property list.
+ * @param length Length of the property list.
+ * @param offset Pointer to the position of the property, advanced past it.
+ * @param property Pointer to receive the decoded property.
+ * @retval true if decoded, false at the end of the list or if the property is malformed.
+ */
+static bool read_property(const uint8_t *data, uint32_t length, uint32_t *offset, stm_mqtt_property_t *property)
+{
+    if (*offset >= length)
+    {
+        return false;
+    }
+    memset(property, 0, sizeof(*property));
+    property->identifier = data[(*offset)++];
+
+    switch (property_type(property->identifier))
+    {
+    case PROPERTY_BYTE:
+        if (*offset + 1 > length)
+        {
+            return false;
+        }
+        property->value = data[*offset];
+        *offset += 1;
+        return true;
+    case PROPERTY_UINT16:
+        if (*offset + 2 > length)
+        {
+            return false;
+        }
+        property->value = read_uint16(&data[*offset]);
+        *offset += 2;
+        return true;
+    case PROPERTY_UINT32:
+        if (*offset + 4 > length)
+        {
+            return false;
+        }
+        property->value = ((uint32_t) read_uint16(&data[*offset]) << 16) | read_uint16(&data[*offset + 2]);
+        *offset += 4;
+        return true;
+    case PROPERTY_VARIABLE:
+        return read_variable_integer(data, length, offset, &property->value);
+    case PROPERTY_BINARY:
+        return read_binary(data, length, offset, &property->data, &property->length);
+    case PROPERTY_PAIR:
+        return read_binary(data, length, offset, &property->data, &property->length)
+            && read_binary(data, length, offset, &property->pair_data, &property->pair_length);
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Reads the property list of an MQTT 5 packet into the event.
+ * @param body Pointer to the packet body.
+ * @param length Length of the packet body.
+ * @param offset Pointer to the position of the Property Length, advanced past the properties.
+ * @param event Pointer to the event receiving the property list.
+ * @retval true if the list fits into the packet, false otherwise.
+ */
+static bool read_properties(const uint8_t *body, uint32_t length, uint32_t *offset, stm_mqtt_event_t *event)
+{
+    uint32_t properties_length;
+    if (!read_variable_integer(body, length, offset, &properties_length) ||
+        *offset + properties_length > length)
+    {
+        return false;
+    }
+    event->properties = &body[*offset];
+    event->properties_length = properties_length;
+    *offset += properties_length;
+    return true;
+}
+
+/**
+ * @brief Restarts the decoder at the beginning of a packet.
+ */
+static void reset_decoder(void)
+{
+    s_decoder.state = DECODER_FIXED_HEADER;
+    s_decoder.remaining_length = 0;
+    s_decoder.multiplier = 1;
+    s_decoder.received = 0;
+}
+
+/**
+ * @brief Sends a stored PUBLISH, with the DUP flag set if it was sent before.
+ *
+ * A QoS 2 message the broker has already received is continued with
+ * PUBREL instead, the PUBLISH must not be sent again.
+ *
+ * @param message Pointer to the in-flight message.
+ * @retval true if queued for transmission, false if the transmit queue is full.
+ */
+static bool retransmit(inflight_message_t *message)
+{
+    if (message->state == INFLIGHT_AWAIT_PUBCOMP)
+    {
+        if (!send_acknowledgement(0x62, message->packet_identifier)) // PUBREL
+        {
+            return false;
+        }
+        message->transmitted = true;
+        message->sent_tick = HAL_GetTick();
+        return true;
+    }
+
+    uint32_t start = message->offset & s_inflight_ring.mask;
+    uint32_t first_part = (s_inflight_ring.mask + 1) - start;
+    if (first_part > message->length)
+    {
+        first_part = message->length;
+    }
+    if (message->transmitted)
+    {
+        s_inflight_storage[start] |= 0x08; // DUP flag
+    }
+
+    // A packet stored across the end of the storage is sent as two segments
+    esp8266_segment_t segments[2] = {
+        { &s_inflight_storage[start], first_part },
+        { s_inflight_storage, message->length - first_part }
+    };
+    if (!transmit_segments(segments, (first_part < message->length) ? 2 : 1))
+    {
+        return false;
+    }
+    message->transmitted = true;
+    message->sent_tick = HAL_GetTick();
+    return true;
+}
+
+/**
+ * @brief Finds an in-flight message.
+ * @param packet_identifier Packet identifier.
+ * @param state State the message must be in.
+ * @retval Pointer to the message, NULL if there is none.
+ */
+static inflight_message_t *find_inflight(uint16_t packet_identifier, inflight_state_t state)
+{
+    for (uint8_t i = s_inflight_tail; i != s_inflight_head; i++)
+    {
+        inflight_message_t *message = &s_inflight[i % STM_MQTT_INFLIGHT_WINDOW];
+        if (message->state == state && message->packet_identifier == packet_identifier)
+        {
+            return message;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Marks an in-flight message as acknowledged and releases finished slots.
+ *
+ * Acknowledgements may arrive out of order, storage is released in order
+ * once every older message is acknowledged too.
+ *
+ * @param message Pointer to the acknowledged message, NULL if the acknowledgement matched none.
+ */
+static void acknowledge_inflight(inflight_message_t *message)
+{
+    if (message == NULL)
+    {
+        return;
+    }
+    message->state = INFLIGHT_ACKNOWLEDGED;
+    while (s_inflight_tail != s_inflight_head &&
+           s_inflight[s_inflight_tail % STM_MQTT_INFLIGHT_WINDOW].state == INFLIGHT_ACKNOWLEDGED)
+    {
+        message = &s_inflight[s_inflight_tail % STM_MQTT_INFLIGHT_WINDOW];
+        ring_buffer_discard(&s_inflight_ring, message->length);
+        message->state = INFLIGHT_FREE;
+        s_inflight_tail++;
+    }
+}
+
+/**
+ * @brief Gives up an in-flight PUBLISH that can never be sent and reports it.
+ *
+ * The message is reported like a broker refusal, a PUBACK or PUBREC event
+ * with reason code 0x95 (Packet too large), so that the caller sees the
+ * outcome of every packet identifier it was given.
+ *
+ * @param message Pointer to the in-flight message.
+ */
+static void drop_inflight(inflight_message_t *message)
+{
+    stm_mqtt_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = (message->state == INFLIGHT_AWAIT_PUBACK) ? STM_MQTT_EVENT_PUBACK : STM_MQTT_EVENT_PUBREC;
+    event.packet_identifier = message->packet_identifier;
+    event.return_code = 0x95;
+    acknowledge_inflight(message);
+    if (s_event_callback != NULL)
+    {
+        s_event_callback(&event);
+    }
+}
+
+/**
+ * @brief Continues an outgoing QoS 2 flow after PUBREC.
+ * @param packet_identifier Packet identifier from PUBREC.
+ * @param reason_code Reason code from PUBREC, 0 with MQTT 3.1.1.
+ */
+static void handle_pubrec(uint16_t packet_identifier, uint8_t reason_code)
+{
+    inflight_message_t *message = find_inflight(packet_identifier, INFLIGHT_AWAIT_PUBREC);
+    if (message != NULL && reason_code >= 0x80)
+    {
+        acknowledge_inflight(message); // Broker refused the message, no PUBREL follows
+        return;
+    }
+    if (message == NULL)
+    {
+        message = find_inflight(packet_identifier, INFLIGHT_AWAIT_PUBCOMP); // Repeated PUBREC, send PUBREL again
+    }
+    if (message == NULL)
+    {
+        send_acknowledgement(0x62, packet_identifier); // Unknown identifier, let the broker finish its flow
+        return;
+    }
+    message->state = INFLIGHT_AWAIT_PUBCOMP;
+    message->transmitted = false; // PUBREL not sent yet
+    if (!retransmit(message))
+    {
+        message->sent_tick = HAL_GetTick() - STM_MQTT_RETRY_TIMEOUT; // Retry PUBREL on next call
+    }
+}
+
+/**
+ * @brief Handles the packet identifier of a received QoS 2 PUBLISH.
+ *
+ * The identifier stays in the receive table until PUBREL, so a
+ * retransmitted PUBLISH is acknowledged again but not delivered twice.
+ *
+ * @param packet_identifier Packet identifier of the PUBLISH.
+ * @retval true if the message is new and must be delivered, false otherwise.
+ */
+static bool receive_qos2(uint16_t packet_identifier)
+{
+    uint16_t *free_slot = NULL;
+    for (uint8_t i = 0; i < STM_MQTT_QOS2_RECEIVE_SLOTS; i++)
+    {
+        if (s_received_qos2[i] == packet_identifier)
+        {
+            send_acknowledgement(0x50, packet_identifier); // PUBREC for a duplicate
+            return false;
+        }
+        if (s_received_qos2[i] == 0 && free_slot == NULL)
+        {
+            free_slot = &s_received_qos2[i];
+        }
+    }
+    if (free_slot == NULL)
+    {
+        return false; // Table full, no PUBREC so the broker sends the message again later
+    }
+    *free_slot = packet_identifier;
+    send_acknowledgement(0x50, packet_identifier); // PUBREC
+    return true;
+}
+
+/**
+ * @brief Completes an incoming QoS 2 flow after PUBREL.
+ * @param packet_identifier Packet identifier from PUBREL.
+ */
+static void release_qos2(uint16_t packet_identifier)
+{
+    for (uint8_t i = 0; i < STM_MQTT_QOS2_RECEIVE_SLOTS; i++)
+    {
+        if (s_received_qos2[i] == packet_identifier)
+        {
+            s_received_qos2[i] = 0;
+        }
+    }
+    send_acknowledgement(0x70, packet_identifier); // PUBCOMP
+}
+
+/**
+ * @brief Retransmits in-flight PUBLISHes that were not acknowledged in time.
+ *
+ * MQTT 5 forbids resending on a live connection, there only messages that
+ * could not be queued yet are sent and the rest waits for the next
+ * connect. A full transmit queue only postpones the remaining messages to
+ * the next call. A PUBLISH larger than the Maximum Packet Size of the current
+ * connection can never be sent and is dropped, so it does not block the
+ * window.
+ *
+ * @param all true to retransmit every unacknowledged message regardless of its age.
+ */
+static void retransmit_inflight(bool all)
+{
+    if (!s_session_active)
+    {
+        return;
+    }
+    for (uint8_t i = s_inflight_tail; i != s_inflight_head; i++)
+    {
+        inflight_message_t *message = &s_inflight[i % STM_MQTT_INFLIGHT_WINDOW];
+        bool due = all || !message->transmitted ||
+                   (s_protocol_version != STM_MQTT_PROTOCOL_5 && HAL_GetTick() - message->sent_tick >= STM_MQTT_RETRY_TIMEOUT);
+        if (message->state != INFLIGHT_ACKNOWLEDGED && message->state != INFLIGHT_FREE && due) // FREE: released by drop_inflight()
+        {
+            if (message->state != INFLIGHT_AWAIT_PUBCOMP &&
+                (message->length > ESP8266_MAX_SEND_SIZE || message->length > s_server_maximum_packet_size))
+            {
+                drop_inflight(message);
+                continue;
+            }
+            if (!retransmit(message))
+            {
+                break; // Transmit queue full, retry on next call
+            }
+        }
+    }
+}
+
+/**
+ * @brief Sends PINGREQ when a keep alive period passed without sending or receiving and detects a dead link.
+ *
+ * Outgoing packets satisfy the broker, but only incoming data proves the
+ * link is alive, so a node that keeps publishing still probes a silent
+ * broker. A PINGREQ unanswered within STM_MQTT_PINGRESP_TIMEOUT is repeated
+ * at once, after STM_MQTT_KEEP_ALIVE_MISSES misses the link is declared dead.
+ */
+static void service_keep_alive(void)
+{
+    if (!s_session_active || s_keep_alive_interval == 0)
+    {
+        return;
+    }
+
+    uint32_t now = HAL_GetTick();
+    if (s_ping_outstanding)
+    {
+        if (now - s_ping_tick < STM_MQTT_PINGRESP_TIMEOUT)
+        {
+            return;
+        }
+        s_ping_outstanding = false;
+        if (++s_missed_pings >= STM_MQTT_KEEP_ALIVE_MISSES)
+        {
+            s_session_active = false;
+            if (s_event_callback != NULL)
+            {
+                stm_mqtt_event_t event;
+                memset(&event, 0, sizeof(event));
+                event.type = STM_MQTT_EVENT_CONNECTION_LOST;
+                s_event_callback(&event);
+            }
+            return;
+        }
+    }
+    else if (now - s_last_transmit_tick < s_keep_alive_interval && now - s_last_receive_tick < s_keep_alive_interval)
+    {
+        return;
+    }
+
+    static const uint8_t pingreq[2] = { 0xC0, 0x00 };
+    if (transmit(pingreq, sizeof(pingreq)))
+    {
+        s_ping_tick = now;
+        s_ping_outstanding = true;
+    }
+}
+
+/**
+ * @brief Tells whether a trie node holds the given level text.
+ * @param node Pointer to the node.
+ * @param text Pointer to the level text.
+ * @param length Length of the level text.
+ * @retval true if equal, false otherwise.
+ */
+static bool trie_node_is(const trie_node_t *node, const char *text, uint16_t length)
+{
+    return node->text_length == length && memcmp(&s_trie_text[node->text_offset], text, length) == 0;
+}
+
+/**
+ * @brief Finds or creates the node of a topic filter.
+ * @param filter Pointer to the topic filter string.
+ * @param create true to add missing levels, false to only look up.
+ * @retval Index of the node, TRIE_NONE if it does not exist or the trie is full.
+ */
+static uint8_t trie_find(const char *filter, bool create)
+{
+    uint8_t node = 0;
+    const char *level = filter;
+    while (true)
     {
-        remaining_bytes = sizeof(g_reception_buffer) - i;
-        if (g_reception_buffer[i] == 0x20)
+        const char *end = strchr(level, '/');
+        uint16_t length = (end != NULL) ? (uint16_t)(end - level) : (uint16_t) strlen(level);
+
+        uint8_t child = s_trie[node].first_child;
+        while (child != TRIE_NONE && !trie_node_is(&s_trie[child], level, length))
+        {
+            child = s_trie[child].next_sibling;
+        }
+        if (child == TRIE_NONE)
         {
-            if (remaining_bytes >= 3)
+            if (!create || s_trie_node_count >= STM_MQTT_TRIE_NODES ||
+                length > 0xFF || s_trie_text_size + length > sizeof(s_trie_text))
             {
-                if (g_reception_buffer[i + 1] == 0x02 && g_reception_buffer[i + 2] == 0x00 && g_reception_buffer[i + 3] == 0x00)
+                return TRIE_NONE;
+            }
+            child = s_trie_node_count++;
+            memcpy(&s_trie_text[s_trie_text_size], level, length);
+            s_trie[child].text_offset = s_trie_text_size;
+            s_trie[child].text_length = length;
+            s_trie[child].first_child = TRIE_NONE;
+            s_trie[child].next_sibling = s_trie[node].first_child;
+            s_trie[child].handler = NULL;
+            s_trie[node].first_child = child;
+            s_trie_text_size += length;
+        }
+        node = child;
+
+        if (end == NULL)
+        {
+            return node;
+        }
+        level = end + 1;
+    }
+}
+
+/**
+ * @brief Calls the handler of a matched trie node.
+ * @param node Index of the node.
+ * @param event Pointer to the PUBLISH event.
+ */
+static void trie_dispatch(uint8_t node, const stm_mqtt_event_t *event)
+{
+    if (s_trie[node].handler != NULL)
+    {
+        s_trie[node].handler(event, s_trie[node].context);
+    }
+}
+
+/**
+ * @brief Delivers a PUBLISH to the handlers of every matching topic filter.
+ *
+ * The topic is walked once, level by level, while the trie nodes that still
+ * match are kept in a frontier. A '+' child follows any level, a '#' child
+ * matches the rest of the topic at once. Topics starting with '$' are not
+ * matched by wildcards in the first level.
+ *
+ * @param event Pointer to the PUBLISH event.
+ */
+static void trie_match(const stm_mqtt_event_t *event)
+{
+    uint8_t frontier[2][STM_MQTT_TRIE_NODES];
+    uint8_t count = 1;
+    uint8_t current = 0;
+    frontier[current][0] = 0;
+
+    const char *level = event->topic;
+    const char *topic_end = event->topic + event->topic_length;
+    bool first_level = true;
+    while (count > 0)
+    {
+        const char *end = memchr(level, '/', topic_end - level);
+        uint16_t length = (end != NULL) ? (uint16_t)(end - level) : (uint16_t)(topic_end - level);
+        bool wildcards = !(first_level && length > 0 && level[0] == '$');
+
+        uint8_t next_count = 0;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            for (uint8_t child = s_trie[frontier[current][i]].first_child; child != TRIE_NONE;
+                 child = s_trie[child].next_sibling)
+            {
+                if (wildcards && trie_node_is(&s_trie[child], "#", 1))
+                {
+                    trie_dispatch(child, event);
+                }
+                else if ((wildcards && trie_node_is(&s_trie[child], "+", 1)) ||
+                         trie_node_is(&s_trie[child], level, length))
                 {
-                    return true;
+                    frontier[current ^ 1][next_count++] = child;
                 }
             }
         }
+        current ^= 1;
+        count = next_count;
+
+        if (end == NULL)
+        {
+            break;
+        }
+        level = end + 1;
+        first_level = false;
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t node = frontier[current][i];
+        trie_dispatch(node, event);
+        for (uint8_t child = s_trie[node].first_child; child != TRIE_NONE; child = s_trie[child].next_sibling)
+        {
+            if (trie_node_is(&s_trie[child], "#", 1)) // "a/#" also matches "a"
+            {
+                trie_dispatch(child, event);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Collects the session state that is kept in flash.
+ * @param record Pointer to the record to fill.
+ */
+static void build_session_record(session_record_t *record)
+{
+    memset(record, 0, sizeof(*record));
+    memcpy(record->received_qos2, s_received_qos2, sizeof(record->received_qos2));
+    uint8_t count = 0;
+    for (uint8_t i = s_inflight_tail; i != s_inflight_head; i++)
+    {
+        inflight_message_t *message = &s_inflight[i % STM_MQTT_INFLIGHT_WINDOW];
+        if (message->state == INFLIGHT_AWAIT_PUBCOMP)
+        {
+            record->released_qos2[count++] = message->packet_identifier;
+        }
+    }
+}
+
+/**
+ * @brief Writes the session record to flash when it differs from the stored one.
+ *
+ * Called from stm_mqtt_process(), so several changes made while decoding
+ * one burst cost a single flash write.
+ */
+static void save_session(void)
+{
+    if (s_clean_session)
+    {
+        return;
+    }
+    session_record_t record;
+    build_session_record(&record);
+    if (memcmp(&record, &s_saved_session, sizeof(record)) != 0 &&
+        session_store_save(&record, sizeof(record)))
+    {
+        s_saved_session = record;
+    }
+}
+
+/**
+ * @brief Restores the session state stored in flash.
+ *
+ * QoS 2 messages that were past PUBREC are put back into the in-flight
+ * window without their content, only PUBREL is sent for them.
+ */
+static void load_session(void)
+{
+    if (!session_store_load(&s_saved_session, sizeof(s_saved_session)))
+    {
+        memset(&s_saved_session, 0, sizeof(s_saved_session));
+        return;
+    }
+    memcpy(s_received_qos2, s_saved_session.received_qos2, sizeof(s_received_qos2));
+    for (uint8_t i = 0; i < STM_MQTT_INFLIGHT_WINDOW; i++)
+    {
+        uint16_t packet_identifier = s_saved_session.released_qos2[i];
+        if (packet_identifier == 0 || (uint8_t)(s_inflight_head - s_inflight_tail) >= STM_MQTT_INFLIGHT_WINDOW)
+        {
+            continue;
+        }
+        inflight_message_t *message = &s_inflight[s_inflight_head++ % STM_MQTT_INFLIGHT_WINDOW];
+        message->state = INFLIGHT_AWAIT_PUBCOMP;
+        message->packet_identifier = packet_identifier;
+        message->offset = s_inflight_ring.head;
+        message->length = 0;
+        message->transmitted = true;
+        message->sent_tick = HAL_GetTick() - STM_MQTT_RETRY_TIMEOUT;
+        if ((uint16_t)(packet_identifier - s_package_identifier_count) < 0x8000)
+        {
+            s_package_identifier_count = packet_identifier + 1; // Do not reuse identifiers still in flight
+        }
+    }
+}
+
+/**
+ * @brief Applies the limits an MQTT 5 broker announces in CONNACK.
+ * @param event Pointer to the CONNACK event.
+ */
+static void apply_connack_properties(const stm_mqtt_event_t *event)
+{
+    uint32_t offset = 0;
+    stm_mqtt_property_t property;
+    while (read_property(event->properties, event->properties_length, &offset, &property))
+    {
+        switch (property.identifier)
+        {
+        case STM_MQTT_PROPERTY_RECEIVE_MAXIMUM:
+            s_server_receive_maximum = property.value;
+            break;
+        case STM_MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+            s_server_maximum_packet_size = property.value;
+            break;
+        case STM_MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM:
+            s_server_topic_alias_maximum = property.value;
+            break;
+        case STM_MQTT_PROPERTY_SERVER_KEEP_ALIVE:
+            s_keep_alive_interval = property.value * 1000; // Broker overrides the requested keep alive
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Sets or resolves the topic alias of a received MQTT 5 PUBLISH.
+ *
+ * A PUBLISH with a topic and an alias sets the alias, one with an empty
+ * topic is given the topic the alias was set to.
+ *
+ * @param event Pointer to the PUBLISH event.
+ * @retval true if the event has a topic, false if the alias is out of range or not set.
+ */
+static bool resolve_topic_alias(stm_mqtt_event_t *event)
+{
+    stm_mqtt_property_t alias;
+    if (!stm_mqtt_find_property(event, STM_MQTT_PROPERTY_TOPIC_ALIAS, &alias))
+    {
+        return true;
+    }
+    if (alias.value == 0 || alias.value > STM_MQTT_TOPIC_ALIASES)
+    {
+        return false;
+    }
+    topic_alias_t *entry = &s_inbound_aliases[alias.value - 1];
+    if (event->topic_length > 0)
+    {
+        // A topic too long to keep leaves the alias unset, messages using it are dropped
+        entry->length = (event->topic_length <= sizeof(entry->topic)) ? event->topic_length : 0;
+        memcpy(entry->topic, event->topic, entry->length);
+        return true;
+    }
+    event->topic = entry->topic;
+    event->topic_length = entry->length;
+    return entry->length > 0;
+}
+
+/**
+ * @brief Converts a complete packet into an event and delivers it.
+ * @param header First byte of the fixed header.
+ * @param body Pointer to variable header and payload.
+ * @param length Length of variable header and payload.
+ */
+static void handle_packet(uint8_t header, const uint8_t *body, uint32_t length)
+{
+    stm_mqtt_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.type = (stm_mqtt_event_type_t)(header >> 4);
+    event.flags = header & 0x0F;
+
+    switch (event.type)
+    {
+    case STM_MQTT_EVENT_CONNACK:
+        if (length < 2)
+        {
+            return;
+        }
+        event.session_present = (body[0] & 0x01) != 0;
+        event.return_code = body[1];
+        if (s_protocol_version == STM_MQTT_PROTOCOL_5)
+        {
+            uint32_t offset = 2;
+            if (!read_properties(body, length, &offset, &event))
+            {
+                return;
+            }
+            apply_connack_properties(&event);
+        }
+        s_connack_return_code = body[1];
+        s_reason_code = body[1];
+        s_session_present = event.session_present;
+        if (!event.session_present)
+        {
+            memset(s_received_qos2, 0, sizeof(s_received_qos2)); // Broker discarded unreleased messages
+        }
+        s_connack_received = true;
+        break;
+
+    case STM_MQTT_EVENT_PUBLISH:
+    {
+        if (length < 2)
+        {
+            return;
+        }
+        uint32_t offset = 2;
+        event.topic_length = read_uint16(body);
+        event.topic = (const char*) &body[offset];
+        offset += event.topic_length;
+        if ((event.flags & 0x06) != 0) // QoS 1 and 2 carry a packet identifier
+        {
+            if (offset + 2 > length)
+            {
+                return;
+            }
+            event.packet_identifier = read_uint16(&body[offset]);
+            offset += 2;
+        }
+        if (offset > length)
+        {
+            return;
+        }
+        if (s_protocol_version == STM_MQTT_PROTOCOL_5 &&
+            (!read_properties(body, length, &offset, &event) || !resolve_topic_alias(&event)))
+        {
+            return;
+        }
+        event.payload = &body[offset];
+        event.payload_length = length - offset;
+
+        uint8_t qos = (event.flags >> 1) & 0x03;
+        if (qos == 1)
+        {
+            send_acknowledgement(0x40, event.packet_identifier); // PUBACK
+        }
+        else if (qos == 2 && !receive_qos2(event.packet_identifier))
+        {
+            return;
+        }
+        break;
+    }
+
+    case STM_MQTT_EVENT_PUBACK:
+    case STM_MQTT_EVENT_PUBREC:
+    case STM_MQTT_EVENT_PUBREL:
+    case STM_MQTT_EVENT_PUBCOMP:
+    {
+        if (length < 2)
+        {
+            return;
+        }
+        event.packet_identifier = read_uint16(body);
+        uint32_t offset = 3;
+        if (length > 2)
+        {
+            event.return_code = body[2]; // MQTT 5 reason code, absent means success
+        }
+        if (length > 3 && !read_properties(body, length, &offset, &event))
+        {
+            return;
+        }
+
+        if (event.type == STM_MQTT_EVENT_PUBACK)
+        {
+            acknowledge_inflight(find_inflight(event.packet_identifier, INFLIGHT_AWAIT_PUBACK));
+        }
+        else if (event.type == STM_MQTT_EVENT_PUBREC)
+        {
+            handle_pubrec(event.packet_identifier, event.return_code);
+        }
+        else if (event.type == STM_MQTT_EVENT_PUBREL)
+        {
+            release_qos2(event.packet_identifier);
+        }
+        else
+        {
+            acknowledge_inflight(find_inflight(event.packet_identifier, INFLIGHT_AWAIT_PUBCOMP));
+        }
+        break;
+    }
+
+    case STM_MQTT_EVENT_UNSUBACK:
+    case STM_MQTT_EVENT_SUBACK:
+    {
+        uint32_t offset = 2;
+        if (length < 2 ||
+            (s_protocol_version == STM_MQTT_PROTOCOL_5 && !read_properties(body, length, &offset, &event)))
+        {
+            return;
+        }
+        event.packet_identifier = read_uint16(body);
+        event.return_codes = &body[offset];
+        event.return_code_count = length - offset; // MQTT 3.1.1 UNSUBACK has none
+        if (event.return_code_count > 0)
+        {
+            event.return_code = body[offset];
+        }
+        else if (event.type == STM_MQTT_EVENT_SUBACK)
+        {
+            return;
+        }
+
+        bool failed = false;
+        for (uint16_t i = 0; i < event.return_code_count; i++)
+        {
+            if (event.type == STM_MQTT_EVENT_SUBACK && s_suback_return_codes != NULL && i < s_suback_return_code_count)
+            {
+                s_suback_return_codes[i] = event.return_codes[i];
+            }
+            if (event.return_codes[i] >= 0x80 && !failed)
+            {
+                failed = true;
+                s_reason_code = event.return_codes[i];
+            }
+        }
+        if (event.type == STM_MQTT_EVENT_SUBACK)
+        {
+            s_suback_failed |= failed;
+            s_suback_identifier = event.packet_identifier;
+        }
+        else
+        {
+            s_unsuback_failed |= failed;
+            s_unsuback_identifier = event.packet_identifier;
+        }
+        break;
+    }
+
+    case STM_MQTT_EVENT_DISCONNECT:
+    {
+        uint32_t offset = 1;
+        if (length > 0)
+        {
+            event.return_code = body[0];
+        }
+        if (length > 1 && !read_properties(body, length, &offset, &event))
+        {
+            return;
+        }
+        s_reason_code = event.return_code;
+        s_session_active = false; // Broker closes the TCP connection next
+        break;
+    }
+
+    case STM_MQTT_EVENT_PINGRESP:
+        if (s_ping_outstanding)
+        {
+            s_ping_latency = HAL_GetTick() - s_ping_tick;
+            s_ping_outstanding = false;
+        }
+        s_missed_pings = 0;
+        break;
+
+    default:
+        return; // Not a packet a broker sends to a client
+    }
+
+    if (event.type == STM_MQTT_EVENT_PUBLISH)
+    {
+        trie_match(&event);
+    }
+    if (s_event_callback != NULL)
+    {
+        s_event_callback(&event);
+    }
+}
+
+/**
+ * @brief Decodes the TCP data received since the previous call.
+ *
+ * The decoder keeps its state between calls, so every byte is handled once
+ * and all packets of a burst are delivered in order.
+ */
+static void decode_received_data(void)
+{
+    uint8_t byte;
+    if (ring_buffer_count(&g_reception_ring) > 0)
+    {
+        s_last_receive_tick = HAL_GetTick(); // Any byte from the broker shows the link is alive
+    }
+    while (ring_buffer_count(&g_reception_ring) > 0)
+    {
+        switch (s_decoder.state)
+        {
+        case DECODER_FIXED_HEADER:
+            ring_buffer_read(&g_reception_ring, &s_decoder.header, 1);
+            s_decoder.state = DECODER_REMAINING_LENGTH;
+            break;
+
+        case DECODER_REMAINING_LENGTH:
+            ring_buffer_read(&g_reception_ring, &byte, 1);
+            s_decoder.remaining_length += (byte & 0x7F) * s_decoder.multiplier;
+            s_decoder.multiplier *= 128;
+            if ((byte & 0x80) == 0)
+            {
+                s_decoder.state = (s_decoder.remaining_length <= sizeof(s_receive_packet)) ? DECODER_BODY : DECODER_SKIP;
+            }
+            else if (s_decoder.multiplier > 128 * 128 * 128)
+            {
+                reset_decoder(); // Remaining Length is at most 4 bytes, stream is out of sync
+                break;
+            }
+            if (s_decoder.state == DECODER_BODY && s_decoder.remaining_length == 0)
+            {
+                handle_packet(s_decoder.header, s_receive_packet, 0);
+                reset_decoder();
+            }
+            break;
+
+        case DECODER_BODY:
+            s_decoder.received += ring_buffer_read(&g_reception_ring, &s_receive_packet[s_decoder.received],
+                                                   s_decoder.remaining_length - s_decoder.received);
+            if (s_decoder.received == s_decoder.remaining_length)
+            {
+                handle_packet(s_decoder.header, s_receive_packet, s_decoder.remaining_length);
+                reset_decoder();
+            }
+            break;
+
+        case DECODER_SKIP:
+        {
+            uint32_t skipped = ring_buffer_count(&g_reception_ring);
+            if (skipped > s_decoder.remaining_length - s_decoder.received)
+            {
+                skipped = s_decoder.remaining_length - s_decoder.received;
+            }
+            ring_buffer_discard(&g_reception_ring, skipped);
+            s_decoder.received += skipped;
+            if (s_decoder.received == s_decoder.remaining_length)
+            {
+                reset_decoder();
+            }
+            break;
+        }
+        }
+    }
+}
+
+/**
+ * @brief Returns the next packet identifier, skipping the invalid value 0.
+ * @retval Packet identifier.
+ */
+static uint16_t next_packet_identifier(void)
+{
+    if (s_package_identifier_count == 0)
+    {
+        s_package_identifier_count++;
+    }
+    return s_package_identifier_count++;
+}
+
+/**
+ * @brief Encodes the MQTT variable length Remaining Length field.
+ * @param length Value to encode, below 268435456.
+ * @param encoded Pointer to at least 4 bytes receiving the encoding.
+ * @retval Number of bytes written.
+ */
+static uint8_t encode_remaining_length(uint32_t length, uint8_t *encoded)
+{
+    uint8_t size = 0;
+    do
+    {
+        uint8_t byte = length % 128;
+        length /= 128;
+        if (length > 0)
+        {
+            byte |= 0x80; // More bytes follow
+        }
+        encoded[size++] = byte;
+    } while (length > 0 && size < 4);
+    return size;
+}
+
+/**
+ * @brief Returns the number of bytes a Remaining Length value takes.
+ * @param length Remaining Length value.
+ * @retval Number of bytes, 1 to 4.
+ */
+static uint8_t remaining_length_size(uint32_t length)
+{
+    return (length < 128) ? 1 : (length < 16384) ? 2 : (length < 2097152) ? 3 : 4;
+}
+
+/**
+ * @brief Appends a byte to the packet body.
+ * @param size Pointer to the body length, advanced past the value.
+ * @param value Value to append.
+ * @retval true if the value fits into the transmit buffer, false otherwise.
+ */
+static bool put_uint8(uint16_t *size, uint8_t value)
+{
+    if (FIXED_HEADER_MAX_SIZE + *size + 1 > TRANSMIT_BUFFER_SIZE)
+    {
+        return false;
     }
-    return false;
+    s_transmit_buffer[FIXED_HEADER_MAX_SIZE + (*size)++] = value;
+    return true;
 }
 
 /**
- * @brief Checks if the SUBACK message with given package identifier is received.
- * @param package_identifier Package identifier to check in SUBACK message.
- * @retval true if SUBACK message with given package identifier is received, false otherwise.
+ * @brief Appends a big-endian 16-bit value to the packet body.
+ * @param size Pointer to the body length, advanced past the value.
+ * @param value Value to append.
+ * @retval true if the value fits into the transmit buffer, false otherwise.
  */
-static bool is_suback_received(int package_identifier)
+static bool put_uint16(uint16_t *size, uint16_t value)
 {
-    int remaining_bytes = 0;
-    for (uint16_t i = 0; i < sizeof(g_reception_buffer); i++)
+    if (FIXED_HEADER_MAX_SIZE + *size + 2 > TRANSMIT_BUFFER_SIZE)
     {
-        remaining_bytes = sizeof(g_reception_buffer) - i;
-        if (g_reception_buffer[i] == 0x90)
-        {
-            if (remaining_bytes >= 4)
-            {
-                if (g_reception_buffer[i + 2] == 0x00 &&
-                    g_reception_buffer[i + 3] == package_identifier)
-                {
-                    return true;
-                }
-            }
-        }
+        return false;
     }
-    return false;
+    s_transmit_buffer[FIXED_HEADER_MAX_SIZE + (*size)++] = value >> 8;
+    s_transmit_buffer[FIXED_HEADER_MAX_SIZE + (*size)++] = value & 0xFF;
+    return true;
+}
+
+/**
+ * @brief Appends a big-endian 32-bit value to the packet body.
+ * @param size Pointer to the body length, advanced past the value.
+ * @param value Value to append.
+ * @retval true if the value fits into the transmit buffer, false otherwise.
+ */
+static bool put_uint32(uint16_t *size, uint32_t value)
+{
+    return put_uint16(size, value >> 16) && put_uint16(size, value & 0xFFFF);
+}
+
+/**
+ * @brief Appends raw bytes to the packet body.
+ * @param size Pointer to the body length, advanced past the data.
+ * @param data Pointer to the data.
+ * @param length Number of bytes to append.
+ * @retval true if the data fits into the transmit buffer, false otherwise.
+ */
+static bool put_bytes(uint16_t *size, const void *data, size_t length)
+{
+    if (FIXED_HEADER_MAX_SIZE + *size + length > TRANSMIT_BUFFER_SIZE)
+    {
+        return false;
+    }
+    memcpy(&s_transmit_buffer[FIXED_HEADER_MAX_SIZE + *size], data, length);
+    *size += length;
+    return true;
+}
+
+/**
+ * @brief Appends a length-prefixed UTF-8 string to the packet body.
+ * @param size Pointer to the body length, advanced past the string.
+ * @param text Pointer to the null terminated string.
+ * @retval true if the string fits into the transmit buffer, false otherwise.
+ */
+static bool put_string(uint16_t *size, const char *text)
+{
+    size_t length = strlen(text);
+    return length <= 0xFFFF && put_uint16(size, length) && put_bytes(size, text, length);
+}
+
+/**
+ * @brief Places the fixed header in front of the packet body and queues the packet.
+ *
+ * The body is built FIXED_HEADER_MAX_SIZE bytes into the transmit buffer,
+ * so the header is written right in front of it and nothing is moved.
+ *
+ * @param header First byte of the fixed header (packet type and flags).
+ * @param size Length of the packet body.
+ * @retval true if the packet was queued, false otherwise.
+ */
+static bool queue_packet(uint8_t header, uint16_t size)
+{
+    uint8_t length_size = remaining_length_size(size);
+    if ((uint32_t)(1 + length_size + size) > s_server_maximum_packet_size)
+    {
+        return false;
+    }
+    uint8_t *packet = &s_transmit_buffer[FIXED_HEADER_MAX_SIZE - 1 - length_size];
+    packet[0] = header;
+    encode_remaining_length(size, &packet[1]);
+    return transmit(packet, 1 + length_size + size);
+}
+
+/**
+ * @brief Appends the MQTT 5 CONNECT properties to the packet body.
+ *
+ * Receive Maximum is the number of QoS 2 messages that can wait for PUBREL,
+ * Maximum Packet Size the receive buffer, so the broker never sends a
+ * packet the decoder would have to skip.
+ *
+ * @param size Pointer to the body length, advanced past the properties.
+ * @retval true if the properties fit into the transmit buffer, false otherwise.
+ */
+static bool put_connect_properties(uint16_t *size)
+{
+    uint16_t length_position = *size;
+    bool built = put_uint8(size, 0) // Property Length, set below
+        && put_uint8(size, STM_MQTT_PROPERTY_RECEIVE_MAXIMUM) && put_uint16(size, STM_MQTT_QOS2_RECEIVE_SLOTS)
+        && put_uint8(size, STM_MQTT_PROPERTY_MAXIMUM_PACKET_SIZE) && put_uint32(size, RECEIVE_PACKET_SIZE)
+        && put_uint8(size, STM_MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM) && put_uint16(size, STM_MQTT_TOPIC_ALIASES);
+    if (built && !s_clean_session)
+    {
+        // Without it an MQTT 5 session ends with the connection
+        built = put_uint8(size, STM_MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL)
+            && put_uint32(size, STM_MQTT_SESSION_EXPIRY_INTERVAL);
+    }
+    if (built)
+    {
+        s_transmit_buffer[FIXED_HEADER_MAX_SIZE + length_position] = *size - length_position - 1; // Below 128, one byte
+    }
+    return built;
+}
+
+/**
+ * @brief Selects the protocol version of the following connects.
+ * @param version STM_MQTT_PROTOCOL_3_1_1 or STM_MQTT_PROTOCOL_5.
+ */
+void stm_mqtt_set_protocol_version(stm_mqtt_protocol_t version)
+{
+    s_protocol_version = version;
 }
 
 /**
@@ -67,62 +1428,380 @@ static bool is_suback_received(int package_identifier)
  * @retval true if connection is successful, false otherwise.
  */
 bool stm_mqtt_connect(const char* address, int port, const char *client_id, int keep_alive)
+{
+    return connect_to_tcp_server(address, port) && stm_mqtt_connect_session(client_id, keep_alive);
+}
+
+/**
+ * @brief Starts an MQTT session over an already established TCP connection.
+ * @param client_id Pointer to the client identifier string.
+ * @param keep_alive Keep-alive interval in seconds.
+ * @retval true if the broker accepted the connection, false otherwise.
+ */
+bool stm_mqtt_connect_session(const char *client_id, int keep_alive)
 {
     bool result = false;
-    if (connect_to_tcp_server(address, port))
-    {
-        memset(s_transmit_buffer, 0 , sizeof(s_transmit_buffer));
-        uint8_t size = 2;
-        s_transmit_buffer[0] = 0x10; // MQTT Control Packet type (CONNECT)
-        s_transmit_buffer[size++] = 0x00; // Remaining length (placeholder)
-        s_transmit_buffer[size++] = 0x04; // Protocol Name Length (MQTT)
-        s_transmit_buffer[size++] = 'M';  // Protocol Name
-        s_transmit_buffer[size++] = 'Q';
-        s_transmit_buffer[size++] = 'T';
-        s_transmit_buffer[size++] = 'T';
-        s_transmit_buffer[size++] = 0x04; // Protocol Level (MQTT 3.1.1)
-        s_transmit_buffer[size++] = 0x02; // Connect Flags (Clean Session)
-        s_transmit_buffer[size++] = 0x00; // Keep Alive MSB (0 for now)
-        s_transmit_buffer[size++] = keep_alive; // Keep Alive LSB (Keep-alive interval)
-        s_transmit_buffer[size++] = 0x00; // Client ID Length (placeholder)
-
-        uint8_t client_id_size = strlen(client_id);
-        s_transmit_buffer[size++] = client_id_size; // Client ID Length
-        memcpy(&s_transmit_buffer[size], client_id, client_id_size); // Client ID
-        size += client_id_size;
-        s_transmit_buffer[1] = size - 2; // Update Remaining Length field
-        clear_reception_buffer();
-        send_buffer(s_transmit_buffer, size);
-        HAL_Delay(100); // Delay to wait for response
-        if (is_connact_received())
-        {
-            result = true;
-        }
-        clear_reception_buffer();
+    uint16_t size = 0;
+    bool built = put_string(&size, "MQTT")   // Protocol Name
+        && put_uint8(&size, s_protocol_version) // Protocol Level (4 for MQTT 3.1.1, 5 for MQTT 5)
+        && put_bytes(&size, s_clean_session ? "\x02" : "\x00", 1) // Connect Flags (Clean Session / Clean Start)
+        && put_uint16(&size, keep_alive)   // Keep Alive
+        && (s_protocol_version != STM_MQTT_PROTOCOL_5 || put_connect_properties(&size)) // Properties
+        && put_string(&size, client_id);   // Client ID
+
+    clear_reception_buffer();
+    reset_decoder();
+    s_connack_received = false;
+    s_session_active = false;
+    s_keep_alive_interval = (uint32_t)(keep_alive & 0xFFFF) * 1000;
+    s_ping_outstanding = false;
+    s_missed_pings = 0;
+    s_last_receive_tick = HAL_GetTick();
+    s_reason_code = 0;
+    // Limits and topic aliases are negotiated anew on every connection
+    s_server_receive_maximum = 0xFFFF;
+    s_server_maximum_packet_size = 0xFFFFFFFF;
+    s_server_topic_alias_maximum = 0;
+    s_outbound_alias_count = 0;
+    memset(s_inbound_aliases, 0, sizeof(s_inbound_aliases));
+    if (built && queue_packet(0x10, size) && esp8266_flush_transmit(TRANSMIT_TIMEOUT)) // CONNECT
+    {
+        uint32_t start_tick = HAL_GetTick();
+        while (!s_connack_received && HAL_GetTick() - start_tick < RESPONSE_TIMEOUT)
+        {
+            stm_mqtt_process();
+        }
+        result = s_connack_received && s_connack_return_code == 0;
+    }
+    if (result)
+    {
+        s_session_active = true;
+        retransmit_inflight(true); // Messages not acknowledged on the previous connection
     }
     return result;
 }
 
+/**
+ * @brief Selects between a clean and a persistent session for the following connects.
+ *
+ * With a persistent session the broker keeps subscriptions and queued
+ * messages while the node is offline, and the QoS 2 state is restored from
+ * flash here.
+ *
+ * @param clean_session true for Clean Session, false for a persistent session.
+ */
+void stm_mqtt_set_clean_session(bool clean_session)
+{
+    s_clean_session = clean_session;
+    if (!clean_session)
+    {
+        load_session();
+    }
+}
+
+/**
+ * @brief Tells whether the broker resumed a stored session on the last connect.
+ * @retval true if the session, including subscriptions, was resumed, false otherwise.
+ */
+bool stm_mqtt_session_present(void)
+{
+    return s_session_active && s_session_present;
+}
+
+/**
+ * @brief Marks the session as lost after the TCP connection or Wi-Fi dropped.
+ *
+ * Stops retransmissions and keep alive until the next successful connect,
+ * in-flight messages are kept and sent again then.
+ */
+void stm_mqtt_connection_lost(void)
+{
+    s_session_active = false;
+    s_ping_outstanding = false;
+}
+
+/**
+ * @brief Looks up the outbound topic alias of a topic.
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param known Pointer set to true if the broker already knows the alias, false if it must be sent with the topic.
+ * @retval Alias, 0 if the topic has none and no alias is left for it.
+ */
+static uint16_t find_topic_alias(const char *topic, uint16_t topic_length, bool *known)
+{
+    *known = false;
+    for (uint16_t i = 0; i < s_outbound_alias_count; i++)
+    {
+        if (s_outbound_aliases[i].length == topic_length &&
+            memcmp(s_outbound_aliases[i].topic, topic, topic_length) == 0)
+        {
+            *known = s_outbound_aliases[i].announced; // Until then the topic is sent along again
+            return i + 1;
+        }
+    }
+    if (s_outbound_alias_count >= STM_MQTT_TOPIC_ALIASES ||
+        s_outbound_alias_count >= s_server_topic_alias_maximum ||
+        topic_length == 0 || topic_length > STM_MQTT_TOPIC_ALIAS_LENGTH)
+    {
+        return 0;
+    }
+    return s_outbound_alias_count + 1;
+}
+
+/**
+ * @brief Queues a PUBLISH packet whose payload is gathered from several segments.
+ *
+ * Only the fixed header and topic length are built here, topic and payload
+ * are copied by the ESP8266 driver directly from the caller's memory into
+ * the transmit queue. A QoS 1 or 2 packet is first stored in the in-flight
+ * window and sent from there, so it can be retransmitted.
+ *
+ * With MQTT 5 a QoS 0 packet to a topic successfully sent before on this connection
+ * carries an empty topic and the topic alias. QoS 1 and 2 packets always
+ * carry their topic, as they may be retransmitted on a later connection
+ * where the alias is not set.
+ *
+ * @param header First byte of the fixed header (PUBLISH type and flags).
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments.
+ * @param payload_count Number of payload segments.
+ * @param packet_identifier Pointer to store the packet identifier of a QoS 1 or 2 packet, may be NULL.
+ * @retval true if queued, false if the packet is too large, the in-flight window or the transmit queue is full.
+ */
+static bool queue_publish(uint8_t header, const char *topic, uint16_t topic_length,
+                          const stm_mqtt_segment_t *payload, uint8_t payload_count,
+                          uint16_t *packet_identifier)
+{
+    uint8_t qos = (header >> 1) & 0x03;
+    if (payload_count > STM_MQTT_MAX_PAYLOAD_SEGMENTS)
+    {
+        return false;
+    }
+
+    bool alias_known = false;
+    uint16_t alias = 0;
+    if (s_protocol_version == STM_MQTT_PROTOCOL_5 && qos == 0)
+    {
+        alias = find_topic_alias(topic, topic_length, &alias_known);
+    }
+    uint16_t sent_topic_length = alias_known ? 0 : topic_length;
+    uint8_t properties[4] = { 0, STM_MQTT_PROPERTY_TOPIC_ALIAS, alias >> 8, alias & 0xFF };
+    uint8_t properties_size = 0;
+    if (s_protocol_version == STM_MQTT_PROTOCOL_5)
+    {
+        properties[0] = (alias != 0) ? 3 : 0; // Property Length
+        properties_size = 1 + properties[0];
+    }
+
+    uint32_t remaining_length = 2 + sent_topic_length + ((qos > 0) ? 2 : 0) + properties_size;
+    for (uint8_t i = 0; i < payload_count; i++)
+    {
+        remaining_length += payload[i].length;
+    }
+    uint32_t length = 1 + remaining_length_size(remaining_length) + remaining_length;
+    if (length > ESP8266_MAX_SEND_SIZE)
+    {
+        return false; // Whole packet must fit into one AT+CIPSEND, or it could never be sent
+    }
+    uint8_t inflight_count = s_inflight_head - s_inflight_tail;
+    if (length > s_server_maximum_packet_size ||
+        (qos > 0 && (inflight_count >= STM_MQTT_INFLIGHT_WINDOW || inflight_count >= s_server_receive_maximum ||
+                     ring_buffer_space(&s_inflight_ring) < length)))
+    {
+        return false;
+    }
+
+    uint8_t fixed_header[FIXED_HEADER_MAX_SIZE + 2];
+    uint8_t size = 0;
+    fixed_header[size++] = header;
+    size += encode_remaining_length(remaining_length, &fixed_header[size]);
+    fixed_header[size++] = sent_topic_length >> 8;  // Topic Length MSB
+    fixed_header[size++] = sent_topic_length & 0xFF; // Topic Length LSB
+
+    esp8266_segment_t segments[STM_MQTT_MAX_PAYLOAD_SEGMENTS + 4];
+    uint8_t segment_count = 0;
+    segments[segment_count].data = fixed_header;
+    segments[segment_count++].length = size;
+    segments[segment_count].data = (const uint8_t*) topic;
+    segments[segment_count++].length = sent_topic_length;
+
+    uint8_t identifier_bytes[2];
+    uint16_t identifier = 0;
+    if (qos > 0)
+    {
+        identifier = next_packet_identifier();
+        identifier_bytes[0] = identifier >> 8;
+        identifier_bytes[1] = identifier & 0xFF;
+        segments[segment_count].data = identifier_bytes;
+        segments[segment_count++].length = 2;
+    }
+    if (properties_size > 0)
+    {
+        segments[segment_count].data = properties;
+        segments[segment_count++].length = properties_size;
+    }
+    for (uint8_t i = 0; i < payload_count; i++)
+    {
+        segments[segment_count].data = payload[i].data;
+        segments[segment_count++].length = payload[i].length;
+    }
+
+    if (qos == 0)
+    {
+        if (!transmit_segments(segments, segment_count))
+        {
+            return false;
+        }
+        if (alias != 0 && !alias_known)
+        {
+            // The broker learns the alias from this packet once it is sent, see stm_mqtt_on_send_result()
+            topic_alias_t *entry = &s_outbound_aliases[alias - 1];
+            if (alias > s_outbound_alias_count)
+            {
+                s_outbound_alias_count = alias;
+                entry->length = topic_length;
+                memcpy(entry->topic, topic, topic_length);
+                entry->announced = false;
+            }
+            entry->result_count = s_send_results + esp8266_queued_buffer_count(); // Queued last, reported last
+        }
+        return true;
+    }
+
+    inflight_message_t *message = &s_inflight[s_inflight_head % STM_MQTT_INFLIGHT_WINDOW];
+    message->offset = s_inflight_ring.head;
+    message->length = length;
+    message->packet_identifier = identifier;
+    for (uint8_t i = 0; i < segment_count; i++)
+    {
+        ring_buffer_write(&s_inflight_ring, segments[i].data, segments[i].length);
+    }
+    message->state = (qos == 1) ? INFLIGHT_AWAIT_PUBACK : INFLIGHT_AWAIT_PUBREC;
+    message->transmitted = false;
+    message->sent_tick = HAL_GetTick() - STM_MQTT_RETRY_TIMEOUT; // Sent by next retransmit_inflight() if queue is full
+    s_inflight_head++;
+    retransmit(message);
+    if (packet_identifier != NULL)
+    {
+        *packet_identifier = identifier;
+    }
+    return true;
+}
+
 /**
  * @brief Publishes a message to an MQTT topic with QoS 0.
+ *
+ * The packet is queued for transmission and the function returns immediately.
+ *
+ * @param topic Pointer to the topic string.
+ * @param payload Pointer to the payload string.
+ * @retval true if queued, false if the packet is too large or the transmit queue is full.
+ */
+bool stm_mqtt_publish_qos0(const char *topic, const char *payload)
+{
+    stm_mqtt_segment_t segment = { (const uint8_t*) payload, strlen(payload) };
+    return stm_mqtt_publish_segments_qos0(topic, strlen(topic), &segment, 1);
+}
+
+/**
+ * @brief Publishes a binary message gathered from several buffers with QoS 0.
+ *
+ * The segments are copied straight into the transmit queue, so the caller
+ * may reuse them as soon as the function returns.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments, may be NULL if payload_count is 0.
+ * @param payload_count Number of payload segments, at most STM_MQTT_MAX_PAYLOAD_SEGMENTS.
+ * @retval true if queued, false if the packet is too large or the transmit queue is full.
+ */
+bool stm_mqtt_publish_segments_qos0(const char *topic, uint16_t topic_length,
+                                    const stm_mqtt_segment_t *payload, uint8_t payload_count)
+{
+    return queue_publish(0x30, topic, topic_length, payload, payload_count, NULL); // PUBLISH QoS 0
+}
+
+/**
+ * @brief Publishes a message to an MQTT topic with QoS 1.
  * @param topic Pointer to the topic string.
  * @param payload Pointer to the payload string.
+ * @param packet_identifier Pointer to store the identifier reported back in the PUBACK event, may be NULL.
+ * @retval true if queued, false if the packet is too large or the in-flight window is full.
+ */
+bool stm_mqtt_publish_qos1(const char *topic, const char *payload, uint16_t *packet_identifier)
+{
+    stm_mqtt_segment_t segment = { (const uint8_t*) payload, strlen(payload) };
+    return stm_mqtt_publish_segments_qos1(topic, strlen(topic), &segment, 1, packet_identifier);
+}
+
+/**
+ * @brief Publishes a binary message gathered from several buffers with QoS 1.
+ *
+ * The packet is kept in the in-flight window until PUBACK arrives and sent
+ * again with the DUP flag after a reconnect or, with MQTT 3.1.1 only,
+ * after STM_MQTT_RETRY_TIMEOUT.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments, may be NULL if payload_count is 0.
+ * @param payload_count Number of payload segments, at most STM_MQTT_MAX_PAYLOAD_SEGMENTS.
+ * @param packet_identifier Pointer to store the identifier reported back in the PUBACK event, may be NULL.
+ * @retval true if queued, false if the packet is too large or the in-flight window is full.
  */
-void stm_mqtt_publish_qos0(const char *topic, const char *payload)
+bool stm_mqtt_publish_segments_qos1(const char *topic, uint16_t topic_length,
+                                    const stm_mqtt_segment_t *payload, uint8_t payload_count,
+                                    uint16_t *packet_identifier)
 {
-    uint8_t topic_length = strlen(topic);
-    uint8_t payload_length = strlen(payload);
-    memset(s_transmit_buffer, 0, sizeof(s_transmit_buffer));
-    uint8_t size = 2;
-    s_transmit_buffer[0] = 0x30; // MQTT Control Packet type (PUBLISH QoS 0)
-    s_transmit_buffer[size++] = 0x00; // Remaining length (placeholder)
-    s_transmit_buffer[size++] = topic_length; // Topic Length
-    memcpy(&s_transmit_buffer[size], topic, topic_length); // Topic
-    size += topic_length;
-    memcpy(&s_transmit_buffer[size], payload, payload_length); // Payload
-    size += payload_length;
-    s_transmit_buffer[1] = size - 2; // Update Remaining Length field
-    send_buffer_and_clear_response(s_transmit_buffer, size);
+    return queue_publish(0x32, topic, topic_length, payload, payload_count, packet_identifier); // PUBLISH QoS 1
+}
+
+/**
+ * @brief Publishes a binary message gathered from several buffers with QoS 2.
+ *
+ * The PUBLISH is retransmitted until PUBREC, then PUBREL until PUBCOMP.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments, may be NULL if payload_count is 0.
+ * @param payload_count Number of payload segments, at most STM_MQTT_MAX_PAYLOAD_SEGMENTS.
+ * @param packet_identifier Pointer to store the identifier reported back in the PUBCOMP event, may be NULL.
+ * @retval true if queued, false if the packet is too large or the in-flight window is full.
+ */
+bool stm_mqtt_publish_segments_qos2(const char *topic, uint16_t topic_length,
+                                    const stm_mqtt_segment_t *payload, uint8_t payload_count,
+                                    uint16_t *packet_identifier)
+{
+    return queue_publish(0x34, topic, topic_length, payload, payload_count, packet_identifier); // PUBLISH QoS 2
+}
+
+/**
+ * @brief Returns the number of QoS 1 and 2 messages waiting for acknowledgement.
+ * @retval Number of in-flight messages.
+ */
+uint8_t stm_mqtt_inflight_count(void)
+{
+    return s_inflight_head - s_inflight_tail;
+}
+
+/**
+ * @brief Waits until an acknowledgement with the given packet identifier is decoded.
+ * @param acknowledged Pointer to the identifier of the last acknowledgement of the awaited type.
+ * @param packet_identifier Identifier to wait for.
+ * @retval true if acknowledged within RESPONSE_TIMEOUT, false otherwise.
+ */
+static bool wait_for_acknowledgement(volatile uint16_t *acknowledged, uint16_t packet_identifier)
+{
+    uint32_t start_tick = HAL_GetTick();
+    while (*acknowledged != packet_identifier)
+    {
+        if (HAL_GetTick() - start_tick >= RESPONSE_TIMEOUT)
+        {
+            return false;
+        }
+        stm_mqtt_process();
+    }
+    return true;
 }
 
 /**
@@ -132,80 +1811,190 @@ void stm_mqtt_publish_qos0(const char *topic, const char *payload)
  */
 bool stm_mqtt_subscribe_qos0(const char *topic)
 {
-    bool result = false;
-    uint8_t topic_length = strlen(topic);
-    memset(s_transmit_buffer, 0, sizeof(s_transmit_buffer));
-    uint8_t size = 2;
-    s_transmit_buffer[0] = 0x82; // MQTT Control Packet type (SUBSCRIBE QoS 0)
-    s_transmit_buffer[size++] = 0x00; // Remaining length (placeholder)
-    s_transmit_buffer[size++] = s_package_identifier_count++; // Package Identifier
-    s_transmit_buffer[size++] = 0x00; // Topic Filter Length MSB
-    s_transmit_buffer[size++] = topic_length; // Topic Filter Length LSB
-    memcpy(&s_transmit_buffer[size], topic, topic_length); // Topic Filter
-    size += topic_length;
-    s_transmit_buffer[size++] = 0x00; // Requested QoS
-    s_transmit_buffer[1] = size - 2; // Update Remaining Length field
-
-    clear_reception_buffer();
-    send_buffer(s_transmit_buffer, size);
+    stm_mqtt_subscription_t subscription = { topic, 0 };
+    return stm_mqtt_subscribe(&subscription, 1, NULL);
+}
 
-    if (is_suback_received(s_package_identifier_count - 1))
+/**
+ * @brief Subscribes to several topic filters with one SUBSCRIBE packet.
+ * @param subscriptions Pointer to the filters and their requested QoS.
+ * @param count Number of filters.
+ * @param return_codes Pointer to count bytes receiving the granted QoS or 0x80 per filter, may be NULL.
+ * @retval true if SUBACK arrived and granted every filter, false otherwise.
+ */
+bool stm_mqtt_subscribe(const stm_mqtt_subscription_t *subscriptions, uint8_t count, uint8_t *return_codes)
+{
+    uint16_t packet_identifier = next_packet_identifier();
+    uint16_t size = 0;
+    bool built = count > 0 && put_uint16(&size, packet_identifier) // Packet Identifier
+        && (s_protocol_version != STM_MQTT_PROTOCOL_5 || put_uint8(&size, 0)); // Property Length
+    for (uint8_t i = 0; built && i < count; i++)
     {
-        result = true;
+        built = put_string(&size, subscriptions[i].filter)          // Topic Filter
+            && put_bytes(&size, &subscriptions[i].qos, 1);         // Requested QoS (MQTT 5 options with defaults)
     }
-    clear_reception_buffer();
 
+    s_reason_code = 0;
+    s_suback_identifier = 0;
+    s_suback_return_codes = return_codes;
+    s_suback_return_code_count = count;
+    s_suback_failed = false;
+    bool result = built && queue_packet(0x82, size) && esp8266_flush_transmit(TRANSMIT_TIMEOUT) // SUBSCRIBE
+        && wait_for_acknowledgement(&s_suback_identifier, packet_identifier)
+        && !s_suback_failed;
+    s_suback_return_codes = NULL;
+    s_suback_return_code_count = 0;
     return result;
 }
 
 /**
- * @brief Parses the received MQTT buffer to extract topic and payload.
- * @param topic Pointer to store the extracted topic.
- * @param payload Pointer to store the extracted payload.
- * @retval true if parsing is successful, false otherwise.
+ * @brief Unsubscribes from several topic filters with one UNSUBSCRIBE packet.
+ * @param filters Pointer to the topic filter strings.
+ * @param count Number of filters.
+ * @retval true if UNSUBACK arrived, false otherwise.
  */
-bool stm_mqtt_parse_received_buffer(char *topic, char *payload)
+bool stm_mqtt_unsubscribe(const char *const *filters, uint8_t count)
 {
-    for (uint16_t i = 0; i < sizeof(g_reception_buffer); i++)
+    uint16_t packet_identifier = next_packet_identifier();
+    uint16_t size = 0;
+    bool built = count > 0 && put_uint16(&size, packet_identifier) // Packet Identifier
+        && (s_protocol_version != STM_MQTT_PROTOCOL_5 || put_uint8(&size, 0)); // Property Length
+    for (uint8_t i = 0; built && i < count; i++)
     {
-        if (g_reception_buffer[i] == 0x30) // Check for PUBLISH message
-        {
-            HAL_Delay(30); // Delay to stabilize reception
-            uint8_t package_size = g_reception_buffer[(i + 1) % sizeof(g_reception_buffer)]; // Total size of the MQTT packet
-            if (package_size >= 127) // Check if size is valid
-            {
-                clear_reception_buffer();
-                return false;
-            }
-            package_size += 2;
-            uint8_t topic_length = g_reception_buffer[(i + 3) % sizeof(g_reception_buffer)]; // Length of the topic
-            if (topic_length > 127) // Check if topic length is valid
-            {
-                clear_reception_buffer();
-                return false;
-            }
-            for (uint16_t j = 0; j < topic_length; j++) // Extract topic
-            {
-                topic[j] = g_reception_buffer[(i + 4 + j) % sizeof(g_reception_buffer)];
-            }
-            uint16_t payload_length = package_size - (topic_length + 4); // Calculate payload length
-            for (uint16_t j = 0; j < payload_length; j++) // Extract payload
-            {
-                payload[j] = g_reception_buffer[(i + 4 + topic_length + j) % sizeof(g_reception_buffer)];
-            }
+        built = put_string(&size, filters[i]);                      // Topic Filter
+    }
 
-            uint16_t remaining_bytes = sizeof(g_reception_buffer) - i;
-            if (i + package_size > remaining_bytes) // Handle buffer wrap-around
-            {
-                memset(&g_reception_buffer[i], 0, remaining_bytes);
-                memset(g_reception_buffer, 0, i + package_size - remaining_bytes);
-            }
-            else
-            {
-                memset(&g_reception_buffer[i], 0, package_size);
-            }
+    s_reason_code = 0;
+    s_unsuback_identifier = 0;
+    s_unsuback_failed = false;
+    return built && queue_packet(0xA2, size) && esp8266_flush_transmit(TRANSMIT_TIMEOUT) // UNSUBSCRIBE
+        && wait_for_acknowledgement(&s_unsuback_identifier, packet_identifier)
+        && !s_unsuback_failed;
+}
+
+/**
+ * @brief Returns the reason code of the last refused CONNECT, SUBSCRIBE or UNSUBSCRIBE, or of a DISCONNECT from the broker.
+ * @retval Reason code, or CONNACK return code with MQTT 3.1.1, 0 if the last request succeeded.
+ */
+uint8_t stm_mqtt_last_reason_code(void)
+{
+    return s_reason_code;
+}
+
+/**
+ * @brief Finds an MQTT 5 property of a received packet.
+ * @param event Pointer to the event the property belongs to.
+ * @param identifier Property identifier.
+ * @param property Pointer to receive the first property with the identifier.
+ * @retval true if found, false if the packet has no such property.
+ */
+bool stm_mqtt_find_property(const stm_mqtt_event_t *event, uint8_t identifier, stm_mqtt_property_t *property)
+{
+    uint32_t offset = 0;
+    while (read_property(event->properties, event->properties_length, &offset, property))
+    {
+        if (property->identifier == identifier)
+        {
             return true;
         }
     }
     return false;
 }
+
+/**
+ * @brief Sets the function notified about received packets.
+ * @param callback Function to call, NULL to disable notifications.
+ */
+void stm_mqtt_set_event_callback(stm_mqtt_event_callback_t callback)
+{
+    s_event_callback = callback;
+}
+
+/**
+ * @brief Reports the result of a buffer sent by ESP8266.
+ *
+ * Results arrive in queueing order. An outbound topic alias counts as known
+ * to the broker only once the PUBLISH that set it was sent, after a failed
+ * send the next PUBLISH to the topic carries the topic again.
+ *
+ * @param success true if ESP8266 sent the buffer.
+ */
+void stm_mqtt_on_send_result(bool success)
+{
+    s_send_results++;
+    for (uint16_t i = 0; i < s_outbound_alias_count; i++)
+    {
+        topic_alias_t *entry = &s_outbound_aliases[i];
+        if (!entry->announced && entry->result_count == s_send_results && success)
+        {
+            entry->announced = true;
+        }
+    }
+}
+
+/**
+ * @brief Registers the function that handles messages matching a topic filter.
+ * @param filter Pointer to the topic filter string, may contain '+' and '#' wildcards.
+ * @param handler Function called for each matching PUBLISH.
+ * @param context Passed to handler.
+ * @retval true if registered, false if the filter table is full.
+ */
+bool stm_mqtt_register_handler(const char *filter, stm_mqtt_message_handler_t handler, void *context)
+{
+    uint8_t node = trie_find(filter, true);
+    if (node == TRIE_NONE)
+    {
+        return false;
+    }
+    s_trie[node].handler = handler;
+    s_trie[node].context = context;
+    return true;
+}
+
+/**
+ * @brief Removes the handler of a topic filter.
+ *
+ * The nodes of the filter stay in the table and are reused when the
+ * filter is registered again.
+ *
+ * @param filter Pointer to the topic filter string.
+ */
+void stm_mqtt_unregister_handler(const char *filter)
+{
+    uint8_t node = trie_find(filter, false);
+    if (node != TRIE_NONE)
+    {
+        s_trie[node].handler = NULL;
+    }
+}
+
+/**
+ * @brief Runs the ESP8266 driver, decodes received packets, retransmits unacknowledged ones
+ *        and keeps the connection alive.
+ */
+void stm_mqtt_process(void)
+{
+    esp8266_process();
+    decode_received_data();
+    retransmit_inflight(false);
+    save_session();
+    service_keep_alive();
+}
+
+/**
+ * @brief Tells whether the broker accepted the connection and the link is alive.
+ * @retval true if connected, false otherwise.
+ */
+bool stm_mqtt_is_connected(void)
+{
+    return s_session_active;
+}
+
+/**
+ * @brief Returns the round trip time of the last answered PINGREQ.
+ * @retval Latency in milliseconds, 0 if no PINGRESP was received yet.
+ */
+uint32_t stm_mqtt_ping_latency(void)
+{
+    return s_ping_latency;
+}
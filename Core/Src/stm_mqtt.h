@@ -7,6 +7,196 @@
 #define _STM_MQTT_H_
 
 #include <stdbool.h>
+#include <inttypes.h>
+
+#define STM_MQTT_MAX_PAYLOAD_SEGMENTS 8 /**< Maximum number of segments of a gathered payload */
+
+#ifndef STM_MQTT_INFLIGHT_WINDOW
+#define STM_MQTT_INFLIGHT_WINDOW 8 /**< Maximum number of unacknowledged QoS 1 and 2 messages, must divide 256 */
+#endif
+
+#ifndef STM_MQTT_INFLIGHT_STORAGE_SIZE
+#define STM_MQTT_INFLIGHT_STORAGE_SIZE 4096 /**< Bytes kept for retransmission, must be a power of two */
+#endif
+
+#ifndef STM_MQTT_QOS2_RECEIVE_SLOTS
+#define STM_MQTT_QOS2_RECEIVE_SLOTS 8 /**< Maximum number of received QoS 2 messages waiting for PUBREL */
+#endif
+
+#ifndef STM_MQTT_PINGRESP_TIMEOUT
+#define STM_MQTT_PINGRESP_TIMEOUT 5000 /**< Time in milliseconds to wait for PINGRESP */
+#endif
+
+#ifndef STM_MQTT_KEEP_ALIVE_MISSES
+#define STM_MQTT_KEEP_ALIVE_MISSES 2 /**< Consecutive missed PINGRESPs that declare the link dead */
+#endif
+
+#ifndef STM_MQTT_TRIE_NODES
+#define STM_MQTT_TRIE_NODES 64 /**< Topic levels the subscription table holds, below 255 */
+#endif
+
+#ifndef STM_MQTT_TRIE_TEXT_SIZE
+#define STM_MQTT_TRIE_TEXT_SIZE 512 /**< Bytes for the level texts of the subscription table */
+#endif
+
+#ifndef STM_MQTT_RETRY_TIMEOUT
+#define STM_MQTT_RETRY_TIMEOUT 10000 /**< Time in milliseconds before an unacknowledged message is sent again, MQTT 3.1.1 only */
+#endif
+
+#ifndef STM_MQTT_TOPIC_ALIASES
+#define STM_MQTT_TOPIC_ALIASES 8 /**< MQTT 5 topic aliases kept in each direction */
+#endif
+
+#ifndef STM_MQTT_TOPIC_ALIAS_LENGTH
+#define STM_MQTT_TOPIC_ALIAS_LENGTH 64 /**< Longest topic that gets a topic alias */
+#endif
+
+#ifndef STM_MQTT_SESSION_EXPIRY_INTERVAL
+#define STM_MQTT_SESSION_EXPIRY_INTERVAL 0xFFFFFFFF /**< MQTT 5 session expiry in seconds requested for a persistent session */
+#endif
+
+/**
+ * @brief MQTT protocol version, equal to the CONNECT Protocol Level.
+ */
+typedef enum
+{
+    STM_MQTT_PROTOCOL_3_1_1 = 4, /**< MQTT 3.1.1 (default) */
+    STM_MQTT_PROTOCOL_5 = 5      /**< MQTT 5.0 */
+} stm_mqtt_protocol_t;
+
+/**
+ * @brief MQTT 5 property identifiers.
+ */
+typedef enum
+{
+    STM_MQTT_PROPERTY_PAYLOAD_FORMAT_INDICATOR = 0x01,
+    STM_MQTT_PROPERTY_MESSAGE_EXPIRY_INTERVAL = 0x02,
+    STM_MQTT_PROPERTY_CONTENT_TYPE = 0x03,
+    STM_MQTT_PROPERTY_RESPONSE_TOPIC = 0x08,
+    STM_MQTT_PROPERTY_CORRELATION_DATA = 0x09,
+    STM_MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER = 0x0B,
+    STM_MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL = 0x11,
+    STM_MQTT_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER = 0x12,
+    STM_MQTT_PROPERTY_SERVER_KEEP_ALIVE = 0x13,
+    STM_MQTT_PROPERTY_AUTHENTICATION_METHOD = 0x15,
+    STM_MQTT_PROPERTY_AUTHENTICATION_DATA = 0x16,
+    STM_MQTT_PROPERTY_REQUEST_PROBLEM_INFORMATION = 0x17,
+    STM_MQTT_PROPERTY_WILL_DELAY_INTERVAL = 0x18,
+    STM_MQTT_PROPERTY_REQUEST_RESPONSE_INFORMATION = 0x19,
+    STM_MQTT_PROPERTY_RESPONSE_INFORMATION = 0x1A,
+    STM_MQTT_PROPERTY_SERVER_REFERENCE = 0x1C,
+    STM_MQTT_PROPERTY_REASON_STRING = 0x1F,
+    STM_MQTT_PROPERTY_RECEIVE_MAXIMUM = 0x21,
+    STM_MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22,
+    STM_MQTT_PROPERTY_TOPIC_ALIAS = 0x23,
+    STM_MQTT_PROPERTY_MAXIMUM_QOS = 0x24,
+    STM_MQTT_PROPERTY_RETAIN_AVAILABLE = 0x25,
+    STM_MQTT_PROPERTY_USER_PROPERTY = 0x26,
+    STM_MQTT_PROPERTY_MAXIMUM_PACKET_SIZE = 0x27,
+    STM_MQTT_PROPERTY_WILDCARD_SUBSCRIPTION_AVAILABLE = 0x28,
+    STM_MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER_AVAILABLE = 0x29,
+    STM_MQTT_PROPERTY_SHARED_SUBSCRIPTION_AVAILABLE = 0x2A
+} stm_mqtt_property_identifier_t;
+
+/**
+ * @brief A decoded MQTT 5 property.
+ *
+ * Integer properties fill value, string and binary properties fill data and
+ * length, a user property additionally fills pair_data and pair_length with
+ * its value. Pointers refer to the decoder buffer.
+ */
+typedef struct
+{
+    uint8_t identifier;         /**< Property identifier */
+    uint32_t value;             /**< Value of an integer property */
+    const uint8_t *data;        /**< String or binary data, not null terminated */
+    uint16_t length;            /**< Length of data */
+    const uint8_t *pair_data;   /**< Value string of a user property */
+    uint16_t pair_length;       /**< Length of pair_data */
+} stm_mqtt_property_t;
+
+/**
+ * @brief A part of a published payload.
+ */
+typedef struct
+{
+    const uint8_t *data;  /**< Pointer to the data */
+    uint16_t length;      /**< Number of bytes */
+} stm_mqtt_segment_t;
+
+/**
+ * @brief A topic filter to subscribe.
+ */
+typedef struct
+{
+    const char *filter;   /**< Topic filter string, may contain '+' and '#' wildcards */
+    uint8_t qos;          /**< Requested maximum QoS, 0 to 2 */
+} stm_mqtt_subscription_t;
+
+/**
+ * @brief Type of a received MQTT control packet, equal to the packet type field.
+ */
+typedef enum
+{
+    STM_MQTT_EVENT_CONNACK = 2,   /**< Connection acknowledged */
+    STM_MQTT_EVENT_PUBLISH = 3,   /**< Message received, QoS 2 duplicates are not reported */
+    STM_MQTT_EVENT_PUBACK = 4,    /**< QoS 1 publish acknowledged */
+    STM_MQTT_EVENT_PUBREC = 5,    /**< QoS 2 publish received */
+    STM_MQTT_EVENT_PUBREL = 6,    /**< QoS 2 publish released */
+    STM_MQTT_EVENT_PUBCOMP = 7,   /**< QoS 2 publish completed */
+    STM_MQTT_EVENT_SUBACK = 9,    /**< Subscription acknowledged */
+    STM_MQTT_EVENT_UNSUBACK = 11, /**< Unsubscription acknowledged */
+    STM_MQTT_EVENT_PINGRESP = 13, /**< Ping response */
+    STM_MQTT_EVENT_DISCONNECT = 14, /**< MQTT 5 broker closes the connection, reason in return_code */
+    STM_MQTT_EVENT_CONNECTION_LOST = 16 /**< Not a packet, keep alive declared the link dead */
+} stm_mqtt_event_type_t;
+
+/**
+ * @brief A decoded MQTT control packet.
+ *
+ * Pointers refer to the decoder buffer and are valid only during the callback.
+ */
+typedef struct
+{
+    stm_mqtt_event_type_t type;     /**< Packet type */
+    uint8_t flags;                  /**< Fixed header flags (DUP, QoS and RETAIN for PUBLISH) */
+    uint16_t packet_identifier;     /**< Packet identifier, 0 if the packet has none */
+    bool session_present;           /**< CONNACK session present flag */
+    uint8_t return_code;            /**< CONNACK return code, MQTT 5 reason code or first SUBACK/UNSUBACK reason code */
+    const uint8_t *return_codes;    /**< SUBACK return codes, MQTT 5 UNSUBACK reason codes */
+    uint16_t return_code_count;     /**< Number of SUBACK/UNSUBACK return codes */
+    const uint8_t *properties;      /**< MQTT 5 properties, read with stm_mqtt_find_property() */
+    uint32_t properties_length;     /**< Length of properties, 0 if none */
+    const char *topic;              /**< PUBLISH topic, not null terminated */
+    uint16_t topic_length;          /**< PUBLISH topic length */
+    const uint8_t *payload;         /**< PUBLISH payload */
+    uint32_t payload_length;        /**< PUBLISH payload length */
+} stm_mqtt_event_t;
+
+/**
+ * @brief Function notified about each received packet.
+ * @param event Pointer to the decoded packet.
+ */
+typedef void (*stm_mqtt_event_callback_t)(const stm_mqtt_event_t *event);
+
+/**
+ * @brief Function handling messages that match a registered topic filter.
+ * @param event Pointer to the PUBLISH event.
+ * @param context Context given when the handler was registered.
+ */
+typedef void (*stm_mqtt_message_handler_t)(const stm_mqtt_event_t *event, void *context);
+
+/**
+ * @brief Selects the protocol version of the following connects.
+ *
+ * With MQTT 5 the client advertises its Receive Maximum, Maximum Packet
+ * Size and Topic Alias Maximum in CONNECT and obeys the limits the broker
+ * returns in CONNACK. QoS 0 messages to a topic published before on the
+ * same connection are sent with a 2-byte topic alias instead of the topic.
+ *
+ * @param version STM_MQTT_PROTOCOL_3_1_1 (default) or STM_MQTT_PROTOCOL_5.
+ */
+void stm_mqtt_set_protocol_version(stm_mqtt_protocol_t version);
 
 /**
  * @brief Connects to an MQTT broker.
@@ -18,12 +208,114 @@
  */
 bool stm_mqtt_connect(const char* address, int port, const char *client_id, int keep_alive);
 
+/**
+ * @brief Starts an MQTT session over an already established TCP connection.
+ * @param client_id Pointer to the client identifier string.
+ * @param keep_alive Keep-alive interval in seconds.
+ * @retval true if the broker accepted the connection, false otherwise.
+ */
+bool stm_mqtt_connect_session(const char *client_id, int keep_alive);
+
+/**
+ * @brief Selects between a clean and a persistent session for the following connects.
+ *
+ * With a persistent session the client ID must stay the same across resets.
+ * The broker keeps subscriptions and queues QoS 1 and 2 messages while the
+ * node is offline. Identifiers of unfinished QoS 2 flows are kept in flash
+ * and restored by this call, so call it once before the first connect.
+ *
+ * @param clean_session true for Clean Session (default), false for a persistent session.
+ */
+void stm_mqtt_set_clean_session(bool clean_session);
+
+/**
+ * @brief Tells whether the broker resumed a stored session on the last connect.
+ * @retval true if the session, including subscriptions, was resumed, false otherwise.
+ */
+bool stm_mqtt_session_present(void);
+
+/**
+ * @brief Marks the session as lost after the TCP connection or Wi-Fi dropped.
+ *
+ * In-flight messages are kept and sent again after the next successful connect.
+ */
+void stm_mqtt_connection_lost(void);
+
 /**
  * @brief Publishes a message to an MQTT topic with QoS 0.
+ *
+ * The packet is queued for transmission and the function returns immediately.
+ *
  * @param topic Pointer to the topic string.
  * @param payload Pointer to the payload string.
+ * @retval true if queued, false if the packet is too large or the transmit queue is full.
+ */
+bool stm_mqtt_publish_qos0(const char *topic, const char *payload);
+
+/**
+ * @brief Publishes a binary message gathered from several buffers with QoS 0.
+ *
+ * Topic and payload segments are copied directly into the transmit queue
+ * without a staging buffer, so the caller may reuse them on return.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments, may be NULL if payload_count is 0.
+ * @param payload_count Number of payload segments, at most STM_MQTT_MAX_PAYLOAD_SEGMENTS.
+ * @retval true if queued, false if the packet is too large or the transmit queue is full.
+ */
+bool stm_mqtt_publish_segments_qos0(const char *topic, uint16_t topic_length,
+                                    const stm_mqtt_segment_t *payload, uint8_t payload_count);
+
+/**
+ * @brief Publishes a message to an MQTT topic with QoS 1.
+ * @param topic Pointer to the topic string.
+ * @param payload Pointer to the payload string.
+ * @param packet_identifier Pointer to store the identifier reported back in the PUBACK event, may be NULL.
+ * @retval true if queued, false if the packet is too large or the in-flight window is full.
+ */
+bool stm_mqtt_publish_qos1(const char *topic, const char *payload, uint16_t *packet_identifier);
+
+/**
+ * @brief Publishes a binary message gathered from several buffers with QoS 1.
+ *
+ * Up to STM_MQTT_INFLIGHT_WINDOW messages may wait for PUBACK at once.
+ * Unacknowledged messages are sent again with the DUP flag after a
+ * reconnect and, with MQTT 3.1.1 only, after STM_MQTT_RETRY_TIMEOUT.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments, may be NULL if payload_count is 0.
+ * @param payload_count Number of payload segments, at most STM_MQTT_MAX_PAYLOAD_SEGMENTS.
+ * @param packet_identifier Pointer to store the identifier reported back in the PUBACK event, may be NULL.
+ * @retval true if queued, false if the packet is too large or the in-flight window is full.
  */
-void stm_mqtt_publish_qos0(const char *topic, const char *payload);
+bool stm_mqtt_publish_segments_qos1(const char *topic, uint16_t topic_length,
+                                    const stm_mqtt_segment_t *payload, uint8_t payload_count,
+                                    uint16_t *packet_identifier);
+
+/**
+ * @brief Publishes a binary message gathered from several buffers with QoS 2.
+ *
+ * The message shares the in-flight window with QoS 1 messages. The PUBLISH
+ * is retransmitted until PUBREC arrives, then PUBREL until PUBCOMP.
+ *
+ * @param topic Pointer to the topic, does not need to be null terminated.
+ * @param topic_length Length of the topic.
+ * @param payload Pointer to the payload segments, may be NULL if payload_count is 0.
+ * @param payload_count Number of payload segments, at most STM_MQTT_MAX_PAYLOAD_SEGMENTS.
+ * @param packet_identifier Pointer to store the identifier reported back in the PUBCOMP event, may be NULL.
+ * @retval true if queued, false if the packet is too large or the in-flight window is full.
+ */
+bool stm_mqtt_publish_segments_qos2(const char *topic, uint16_t topic_length,
+                                    const stm_mqtt_segment_t *payload, uint8_t payload_count,
+                                    uint16_t *packet_identifier);
+
+/**
+ * @brief Returns the number of QoS 1 and 2 messages waiting for acknowledgement.
+ * @retval Number of in-flight messages.
+ */
+uint8_t stm_mqtt_inflight_count(void);
 
 /**
  * @brief Subscribes to an MQTT topic with QoS 0.
@@ -33,11 +325,94 @@ void stm_mqtt_publish_qos0(const char *topic, const char *payload);
 bool stm_mqtt_subscribe_qos0(const char *topic);
 
 /**
- * @brief Parses the received MQTT buffer to extract topic and payload.
- * @param topic Pointer to store the extracted topic.
- * @param payload Pointer to store the extracted payload.
- * @retval true if parsing is successful, false otherwise.
+ * @brief Subscribes to several topic filters with one SUBSCRIBE packet.
+ *
+ * All filters travel in a single packet and are acknowledged by a single
+ * SUBACK, which saves one round trip per filter when resubscribing.
+ *
+ * @param subscriptions Pointer to the filters and their requested QoS.
+ * @param count Number of filters.
+ * @param return_codes Pointer to count bytes receiving the granted QoS or a reason code from 0x80 per filter, may be NULL.
+ * @retval true if SUBACK arrived and granted every filter, false otherwise.
+ */
+bool stm_mqtt_subscribe(const stm_mqtt_subscription_t *subscriptions, uint8_t count, uint8_t *return_codes);
+
+/**
+ * @brief Unsubscribes from several topic filters with one UNSUBSCRIBE packet.
+ * @param filters Pointer to the topic filter strings.
+ * @param count Number of filters.
+ * @retval true if UNSUBACK arrived and, with MQTT 5, reported no failure, false otherwise.
+ */
+bool stm_mqtt_unsubscribe(const char *const *filters, uint8_t count);
+
+/**
+ * @brief Returns the reason code of the last refused CONNECT, SUBSCRIBE or UNSUBSCRIBE, or of a DISCONNECT from the broker.
+ * @retval Reason code, or CONNACK return code with MQTT 3.1.1, 0 if the last request succeeded.
+ */
+uint8_t stm_mqtt_last_reason_code(void);
+
+/**
+ * @brief Finds an MQTT 5 property of a received packet.
+ * @param event Pointer to the event the property belongs to.
+ * @param identifier Property identifier, a stm_mqtt_property_identifier_t value.
+ * @param property Pointer to receive the first property with the identifier.
+ * @retval true if found, false if the packet has no such property.
+ */
+bool stm_mqtt_find_property(const stm_mqtt_event_t *event, uint8_t identifier, stm_mqtt_property_t *property);
+
+/**
+ * @brief Sets the function notified about received packets.
+ * @param callback Function to call, NULL to disable notifications.
+ */
+void stm_mqtt_set_event_callback(stm_mqtt_event_callback_t callback);
+
+/**
+ * @brief Reports the result of a buffer sent by ESP8266, to be called with every ESP8266 send result.
+ *
+ * An MQTT 5 topic alias is only used once the PUBLISH that set it was sent,
+ * so the application must forward the results of its
+ * esp8266_set_send_callback() callback here.
+ *
+ * @param success true if ESP8266 sent the buffer.
+ */
+void stm_mqtt_on_send_result(bool success);
+
+/**
+ * @brief Registers the function that handles messages matching a topic filter.
+ *
+ * Filters are kept in a trie of topic levels, so a received topic is matched
+ * against all of them in one pass. Registering an existing filter replaces
+ * its handler. The filter is not subscribed at the broker.
+ *
+ * @param filter Pointer to the topic filter string, may contain '+' and '#' wildcards.
+ * @param handler Function called for each matching PUBLISH.
+ * @param context Passed to handler.
+ * @retval true if registered, false if the filter table is full.
+ */
+bool stm_mqtt_register_handler(const char *filter, stm_mqtt_message_handler_t handler, void *context);
+
+/**
+ * @brief Removes the handler of a topic filter.
+ * @param filter Pointer to the topic filter string.
+ */
+void stm_mqtt_unregister_handler(const char *filter);
+
+/**
+ * @brief Runs the ESP8266 driver, decodes received packets, retransmits unacknowledged ones
+ *        and keeps the connection alive, must be called periodically from the main loop.
+ */
+void stm_mqtt_process(void);
+
+/**
+ * @brief Tells whether the broker accepted the connection and the link is alive.
+ * @retval true if connected, false after a failed connect or when keep alive declared the link dead.
+ */
+bool stm_mqtt_is_connected(void);
+
+/**
+ * @brief Returns the round trip time of the last answered PINGREQ.
+ * @retval Latency in milliseconds, 0 if no PINGRESP was received yet.
  */
-bool stm_mqtt_parse_received_buffer(char *topic, char *payload);
+uint32_t stm_mqtt_ping_latency(void);
 
 #endif // _STM_MQTT_H_
@@ -0,0 +1,173 @@
+/**
+ * @file    telemetry_batch.c
+ * @brief   Aggregates telemetry samples into one MQTT message per topic.
+ *
+ * Every topic in use owns a slot with a fixed buffer. A slot is released
+ * once its batch has been taken by the sink, so topics that stop producing
+ * samples do not hold a slot.
+ */
+
+#include "telemetry_batch.h"
+#include "stm_mqtt.h"
+#include "stm32l4xx_hal.h"
+#include <string.h>
+
+/**
+ * @brief Samples collected for one topic
+ */
+typedef struct
+{
+    const char *topic;        /**< Topic string, NULL if the slot is free */
+    uint16_t length;          /**< Bytes collected in data */
+    uint16_t count;           /**< Samples collected */
+    uint32_t first_tick;      /**< Time the first sample was added */
+    uint8_t data[TELEMETRY_BATCH_MAX_SIZE]; /**< Samples separated by TELEMETRY_BATCH_SEPARATOR */
+} batch_t;
+
+static batch_t s_batches[TELEMETRY_BATCH_TOPICS];
+static telemetry_batch_sink_t s_sink = NULL;
+
+/**
+ * @brief Publishes a batch with QoS 0, the sink used when none is set.
+ * @param topic Topic string of the batch.
+ * @param payload Pointer to the samples.
+ * @param length Length of the payload.
+ * @retval true if queued, false if the transmit queue is full.
+ */
+static bool publish_batch(const char *topic, const uint8_t *payload, uint16_t length)
+{
+    stm_mqtt_segment_t segment = { payload, length };
+    return stm_mqtt_publish_segments_qos0(topic, strlen(topic), &segment, 1);
+}
+
+/**
+ * @brief Hands a batch to the sink and releases its slot.
+ * @param batch Pointer to the batch.
+ * @retval true if taken or empty, false if the sink refused it.
+ */
+static bool send_batch(batch_t *batch)
+{
+    if (batch->count > 0 && !s_sink(batch->topic, batch->data, batch->length))
+    {
+        return false;
+    }
+    batch->topic = NULL;
+    batch->length = 0;
+    batch->count = 0;
+    return true;
+}
+
+/**
+ * @brief Finds the batch of a topic or takes a free slot for it.
+ * @param topic Pointer to the topic string.
+ * @retval Pointer to the batch, NULL if all slots are in use by other topics.
+ */
+static batch_t *find_batch(const char *topic)
+{
+    batch_t *free_batch = NULL;
+    for (uint8_t i = 0; i < TELEMETRY_BATCH_TOPICS; i++)
+    {
+        if (s_batches[i].topic != NULL && strcmp(s_batches[i].topic, topic) == 0)
+        {
+            return &s_batches[i];
+        }
+        if (s_batches[i].topic == NULL && free_batch == NULL)
+        {
+            free_batch = &s_batches[i];
+        }
+    }
+    if (free_batch != NULL)
+    {
+        free_batch->topic = topic;
+    }
+    return free_batch;
+}
+
+/**
+ * @brief Sets where complete batches go, must be called once before use.
+ * @param sink Function taking the batches, NULL to publish them with QoS 0.
+ */
+void telemetry_batch_init(telemetry_batch_sink_t sink)
+{
+    s_sink = (sink != NULL) ? sink : publish_batch;
+    memset(s_batches, 0, sizeof(s_batches));
+}
+
+/**
+ * @brief Appends a sample to the batch of a topic.
+ * @param topic Pointer to the topic string, must stay valid while batched.
+ * @param sample Pointer to the sample.
+ * @param length Length of the sample.
+ * @retval true if batched, false if the sample is too large, all topics are in use or the full batch could not be sent.
+ */
+bool telemetry_batch_add(const char *topic, const uint8_t *sample, uint16_t length)
+{
+    if (length > TELEMETRY_BATCH_MAX_SIZE)
+    {
+        return false;
+    }
+    batch_t *batch = find_batch(topic);
+    if (batch == NULL)
+    {
+        return false;
+    }
+
+    uint16_t separator = (batch->count > 0) ? 1 : 0;
+    if (batch->length + separator + length > TELEMETRY_BATCH_MAX_SIZE)
+    {
+        if (!send_batch(batch))
+        {
+            return false;
+        }
+        batch->topic = topic;
+        separator = 0;
+    }
+    if (batch->count == 0)
+    {
+        batch->first_tick = HAL_GetTick();
+    }
+    if (separator > 0)
+    {
+        batch->data[batch->length++] = TELEMETRY_BATCH_SEPARATOR;
+    }
+    memcpy(&batch->data[batch->length], sample, length);
+    batch->length += length;
+    batch->count++;
+
+    if (batch->count >= TELEMETRY_BATCH_MAX_SAMPLES)
+    {
+        send_batch(batch); // Kept and offered again by telemetry_batch_process() if refused
+    }
+    return true;
+}
+
+/**
+ * @brief Sends every batch that is old enough.
+ */
+void telemetry_batch_process(void)
+{
+    uint32_t now = HAL_GetTick();
+    for (uint8_t i = 0; i < TELEMETRY_BATCH_TOPICS; i++)
+    {
+        batch_t *batch = &s_batches[i];
+        if (batch->topic != NULL &&
+            (batch->count >= TELEMETRY_BATCH_MAX_SAMPLES || now - batch->first_tick >= TELEMETRY_BATCH_MAX_AGE))
+        {
+            send_batch(batch);
+        }
+    }
+}
+
+/**
+ * @brief Sends every non-empty batch regardless of its age.
+ */
+void telemetry_batch_flush(void)
+{
+    for (uint8_t i = 0; i < TELEMETRY_BATCH_TOPICS; i++)
+    {
+        if (s_batches[i].topic != NULL)
+        {
+            send_batch(&s_batches[i]);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef _TELEMETRY_BATCH_H_
+#define _TELEMETRY_BATCH_H_
+
+/**
+ * @file    telemetry_batch.h
+ * @brief   Aggregates telemetry samples into one MQTT message per topic.
+ *
+ * Samples added for a topic are collected in a RAM buffer, separated by
+ * TELEMETRY_BATCH_SEPARATOR, and handed on as one message when the buffer
+ * is full, holds TELEMETRY_BATCH_MAX_SAMPLES samples or its first sample is
+ * TELEMETRY_BATCH_MAX_AGE old. The sampling rate can thus be raised without
+ * raising the number of AT+CIPSEND transactions.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define TELEMETRY_BATCH_TOPICS       4    /**< Topics batched at the same time */
+#define TELEMETRY_BATCH_MAX_SIZE     512  /**< Largest batch in bytes */
+#define TELEMETRY_BATCH_MAX_SAMPLES  50   /**< Samples after which a batch is sent */
+#define TELEMETRY_BATCH_MAX_AGE      1000 /**< Time in milliseconds after which a batch is sent */
+#define TELEMETRY_BATCH_SEPARATOR    '\n' /**< Byte placed between two samples */
+
+/**
+ * @brief Function that takes a complete batch.
+ * @param topic Topic string of the batch.
+ * @param payload Pointer to the samples, valid only during the call.
+ * @param length Length of the payload.
+ * @retval true if taken, false to keep the batch and offer it again later.
+ */
+typedef bool (*telemetry_batch_sink_t)(const char *topic, const uint8_t *payload, uint16_t length);
+
+/**
+ * @brief Sets where complete batches go, must be called once before use.
+ * @param sink Function taking the batches, NULL to publish them with QoS 0.
+ */
+void telemetry_batch_init(telemetry_batch_sink_t sink);
+
+/**
+ * @brief Appends a sample to the batch of a topic.
+ *
+ * A batch that cannot take the sample is sent first.
+ *
+ * @param topic Pointer to the topic string, must stay valid while batched.
+ * @param sample Pointer to the sample.
+ * @param length Length of the sample.
+ * @retval true if batched, false if the sample is too large, all topics are in use or the full batch could not be sent.
+ */
+bool telemetry_batch_add(const char *topic, const uint8_t *sample, uint16_t length);
+
+/**
+ * @brief Sends every batch that is old enough, must be called periodically from the main loop.
+ */
+void telemetry_batch_process(void);
+
+/**
+ * @brief Sends every non-empty batch regardless of its age.
+ */
+void telemetry_batch_flush(void);
+
+#endif // _TELEMETRY_BATCH_H_